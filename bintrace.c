@@ -0,0 +1,174 @@
+/* ******************************************************************
+   Binary event trace.
+
+   The simulation fills a chunk of records.  A full chunk is queued for a
+   writer thread and the simulation carries on with a free chunk, so file
+   output is taken off the simulation thread.  There are TRACECHUNKS
+   chunks.  If all of them are waiting to be written, the simulation
+   waits for the writer, so records are never dropped.
+**********************************************************************/
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "bintrace.h"
+
+#define TRACECHUNK  4096          /* records per chunk */
+#define TRACECHUNKS 4             /* chunks per trace */
+
+struct tracechunk {
+  struct tracechunk *next;
+  int count;                      /* records used */
+  struct tracerec recs[TRACECHUNK];
+};
+
+struct bintrace {
+  FILE *file;
+  pthread_t writer;
+  pthread_mutex_t lock;           /* protects everything below cur */
+  pthread_cond_t changed;         /* a chunk was queued or freed, or closing */
+  struct tracechunk *cur;         /* chunk being filled by the simulation */
+  struct tracechunk *full;        /* chunks waiting to be written, oldest first */
+  struct tracechunk **fulltail;
+  struct tracechunk *free;        /* chunks ready for reuse */
+  int closing;
+  int error;                      /* a write failed */
+};
+
+/* writer thread: write queued chunks until the trace is closed */
+static void *tracewriter(void *arg)
+{
+  struct bintrace *t = arg;
+  struct tracechunk *c;
+  size_t n;
+
+  pthread_mutex_lock(&t->lock);
+  for (;;) {
+    while (t->full == NULL && !t->closing)
+      pthread_cond_wait(&t->changed, &t->lock);
+    if (t->full == NULL)
+      break;
+    c = t->full;
+    t->full = c->next;
+    if (t->full == NULL)
+      t->fulltail = &t->full;
+    pthread_mutex_unlock(&t->lock);
+
+    n = fwrite(c->recs, sizeof(struct tracerec), c->count, t->file);
+
+    pthread_mutex_lock(&t->lock);
+    if (n != (size_t)c->count)
+      t->error = 1;
+    c->count = 0;
+    c->next = t->free;
+    t->free = c;
+    pthread_cond_broadcast(&t->changed);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+
+/* queue the current chunk for the writer */
+static void queuechunk(struct bintrace *t)
+{
+  t->cur->next = NULL;
+  *t->fulltail = t->cur;
+  t->fulltail = &t->cur->next;
+  t->cur = NULL;
+  pthread_cond_broadcast(&t->changed);
+}
+
+struct bintrace *bintrace_open(const char *filename)
+{
+  struct bintrace *t;
+  struct tracechunk *c;
+  struct traceheader h;
+  int i;
+
+  t = calloc(1, sizeof(struct bintrace));
+  if (t == NULL)
+    return NULL;
+  t->file = fopen(filename, "wb");
+  if (t->file == NULL) {
+    free(t);
+    return NULL;
+  }
+  memset(&h, 0, sizeof(h));
+  strcpy(h.magic, BINTRACE_MAGIC);
+  h.recsize = sizeof(struct tracerec);
+  if (fwrite(&h, sizeof(h), 1, t->file) != 1)
+    t->error = 1;
+
+  for (i = 0; i < TRACECHUNKS; i++) {
+    c = malloc(sizeof(struct tracechunk));
+    if (c == NULL) {
+      printf("memory allocation for trace failed.");
+      exit(EXIT_FAILURE);
+    }
+    c->count = 0;
+    c->next = t->free;
+    t->free = c;
+  }
+  t->cur = t->free;
+  t->free = t->cur->next;
+  t->fulltail = &t->full;
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->changed, NULL);
+  if (pthread_create(&t->writer, NULL, tracewriter, t) != 0) {
+    printf("unable to start trace writer\n");
+    exit(EXIT_FAILURE);
+  }
+  return t;
+}
+
+void bintrace_record(struct bintrace *t, float time, int type, int entity,
+                     int flags, int seqnum, int acknum, int checksum)
+{
+  struct tracerec *r;
+
+  if (t->cur->count == TRACECHUNK) {
+    pthread_mutex_lock(&t->lock);
+    queuechunk(t);
+    while (t->free == NULL)
+      pthread_cond_wait(&t->changed, &t->lock);
+    t->cur = t->free;
+    t->free = t->cur->next;
+    pthread_mutex_unlock(&t->lock);
+  }
+  r = &t->cur->recs[t->cur->count++];
+  r->time = time;
+  r->seqnum = seqnum;
+  r->acknum = acknum;
+  r->checksum = checksum;
+  r->type = (unsigned char)type;
+  r->entity = (unsigned char)entity;
+  r->flags = (unsigned char)flags;
+  r->pad = 0;
+}
+
+int bintrace_close(struct bintrace *t)
+{
+  struct tracechunk *c;
+  int error;
+
+  pthread_mutex_lock(&t->lock);
+  queuechunk(t);
+  t->closing = 1;
+  pthread_cond_broadcast(&t->changed);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->writer, NULL);
+
+  /* the writer has put every chunk back on the free list */
+  while ((c = t->free) != NULL) {
+    t->free = c->next;
+    free(c);
+  }
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->changed);
+  error = t->error;
+  if (fclose(t->file) != 0)
+    error = 1;
+  free(t);
+  return error ? -1 : 0;
+}
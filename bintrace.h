@@ -0,0 +1,47 @@
+/* a binary trace is a header followed by fixed-size records, one for
+   every event and every call into the emulator.  tracedump.c turns it
+   back into text or CSV */
+
+#define BINTRACE_MAGIC "EMUTRC1"  /* first 8 bytes of a trace, with the NUL */
+
+/* record types */
+#define TR_TIMEOUT      0         /* timer interrupt at entity */
+#define TR_FROMLAYER5   1         /* message from layer 5 at entity */
+#define TR_FROMLAYER3   2         /* packet arrives at entity */
+#define TR_TOLAYER3     3         /* entity sends a packet */
+#define TR_TOLAYER5     4         /* entity delivers data to layer 5 */
+#define TR_STARTTIMER   5
+#define TR_STOPTIMER    6
+
+/* record flags */
+#define TRF_LOST        0x01      /* the medium lost the packet */
+#define TRF_CORRUPT     0x02      /* the medium corrupted the packet */
+
+struct tracerec {
+  float time;             /* simulation time of the record */
+  int seqnum;             /* packet fields, as sent, for TR_FROMLAYER3 and TR_TOLAYER3 */
+  int acknum;
+  int checksum;
+  unsigned char type;     /* TR_* */
+  unsigned char entity;   /* A or B */
+  unsigned char flags;    /* TRF_* */
+  unsigned char pad;
+};
+
+/* the file starts with the magic and the record size of the writer */
+struct traceheader {
+  char magic[8];
+  int recsize;
+};
+
+struct bintrace;
+
+/* create the trace file, NULL if it can not be created */
+extern struct bintrace *bintrace_open(const char *filename);
+
+/* append a record.  Records are written by a separate thread */
+extern void bintrace_record(struct bintrace *, float time, int type, int entity,
+                            int flags, int seqnum, int acknum, int checksum);
+
+/* write the remaining records and close the file, -1 if writing failed */
+extern int bintrace_close(struct bintrace *);
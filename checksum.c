@@ -0,0 +1,179 @@
+/* ******************************************************************
+   Packet integrity functions.
+
+   - The Internet checksum adds the data 32 bits at a time into a 64-bit
+   accumulator, four words per iteration.  Ones' complement sums do not
+   depend on the word size (2^16 = 1 mod 2^16-1), so the wide sum folds
+   into the RFC 1071 result.  This keeps up with memory bandwidth
+   without any instruction set specific code.
+   - CRC-32C uses the SSE4.2 crc32 instruction when the cpu has it, and
+   slice-by-8 tables otherwise.
+**********************************************************************/
+#include <string.h>
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78UL  /* reflected Castagnoli polynomial */
+
+static uint32_t crctable[8][256];
+static uint32_t (*crc32c_fn)(uint32_t, const unsigned char *, size_t);
+
+uint32_t cksum_inet_add(uint32_t acc, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint64_t sum = acc;
+  uint32_t w[4];
+  uint16_t h;
+
+  while (len >= 16) {
+    memcpy(w, p, 16);
+    sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+    p += 16;
+    len -= 16;
+  }
+  while (len >= 4) {
+    memcpy(w, p, 4);
+    sum += w[0];
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&h, p, 2);
+    sum += h;
+    p += 2;
+    len -= 2;
+  }
+  if (len) {                      /* odd length, pad with a zero byte */
+    h = 0;
+    memcpy(&h, p, 1);
+    sum += h;
+  }
+  while (sum >> 32)
+    sum = (sum & 0xffffffffUL) + (sum >> 32);
+  return (uint32_t)sum;
+}
+
+uint16_t cksum_inet_fold(uint32_t acc)
+{
+  while (acc >> 16)
+    acc = (acc & 0xffff) + (acc >> 16);
+  return (uint16_t)~acc;
+}
+
+/* HC' = ~(~HC + ~m + m'), equation 3 of RFC 1624 */
+uint16_t cksum_inet_update(uint16_t cksum, uint16_t oldword, uint16_t newword)
+{
+  uint32_t sum = (uint16_t)~cksum;
+
+  sum += (uint16_t)~oldword;
+  sum += newword;
+  return cksum_inet_fold(sum);
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint32_t lo, hi;
+
+  while (len >= 8) {
+    lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = crctable[7][lo & 0xff] ^ crctable[6][(lo >> 8) & 0xff]
+        ^ crctable[5][(lo >> 16) & 0xff] ^ crctable[4][lo >> 24]
+        ^ crctable[3][hi & 0xff] ^ crctable[2][(hi >> 8) & 0xff]
+        ^ crctable[1][(hi >> 16) & 0xff] ^ crctable[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = crctable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+  uint64_t c = crc, v;
+
+  while (len >= 8) {
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)c;
+#else
+  uint32_t v;
+
+  while (len >= 4) {
+    memcpy(&v, p, 4);
+    crc = _mm_crc32_u32(crc, v);
+    p += 4;
+    len -= 4;
+  }
+#endif
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+void checksum_init(void)
+{
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crctable[0][i] = c;
+  }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crctable[j][i] = (crctable[j-1][i] >> 8) ^ crctable[0][crctable[j-1][i] & 0xff];
+
+  crc32c_fn = crc32c_table;
+#ifdef CRC32C_SSE42
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_fn = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+  return ~crc32c_fn(~crc, data, len);
+}
+
+const char *crc32c_impl(void)
+{
+  return crc32c_fn == crc32c_table ? "slice-by-8 tables" : "sse4.2";
+}
+
+int checksum_packet(int kind, int seqnum, int acknum, uint32_t sack, int length, const char *payload)
+{
+  int header[4];
+  int checksum, i;
+
+  header[0] = seqnum;
+  header[1] = acknum;
+  memcpy(&header[2], &sack, sizeof(sack));
+  header[3] = length;
+  switch (kind) {
+  case CKSUM_INET:
+    return cksum_inet_fold(cksum_inet_add(cksum_inet_add(0, header, sizeof(header)), payload, length));
+  case CKSUM_CRC32C:
+    return (int)crc32c(crc32c(0, header, sizeof(header)), payload, length);
+  default:
+    checksum = seqnum + acknum + (int)(sack & 0xffff) + (int)(sack >> 16) + length;
+    for (i = 0; i < length; i++)
+      checksum += (int)payload[i];
+    return checksum;
+  }
+}
@@ -0,0 +1,33 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* integrity functions a protocol can use for its packets */
+#define CKSUM_SUM    0    /* sum of the header fields and payload bytes */
+#define CKSUM_INET   1    /* RFC 1071 16-bit ones' complement checksum */
+#define CKSUM_CRC32C 2    /* CRC-32C (Castagnoli) */
+
+/* select the fastest implementations for this cpu.  Must be called
+   before any other routine and before any thread is started */
+extern void checksum_init(void);
+
+/* ones' complement sum of data, added to the partial sum acc.  Partial
+   sums of consecutive pieces can be chained as long as every piece but
+   the last has an even length */
+extern uint32_t cksum_inet_add(uint32_t acc, const void *data, size_t len);
+
+/* fold a partial sum into the final 16-bit checksum */
+extern uint16_t cksum_inet_fold(uint32_t acc);
+
+/* RFC 1624 incremental update: the checksum after one 16-bit word of the
+   data changed from oldword to newword */
+extern uint16_t cksum_inet_update(uint16_t cksum, uint16_t oldword, uint16_t newword);
+
+/* CRC-32C of data, continuing from the CRC of the data before it (0 to
+   start) */
+extern uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/* name of the CRC-32C implementation in use */
+extern const char *crc32c_impl(void);
+
+/* checksum of a packet with the given header fields and payload */
+extern int checksum_packet(int kind, int seqnum, int acknum, uint32_t sack, int length, const char *payload);
@@ -20,8 +20,11 @@
    Network properties:
    - one way network delay averages five time units (longer if there
    are other messages in the channel for GBN), but can be larger
+   - or, with a bandwidth, packets are sent one at a time at that rate
+   and arrive a propagation delay and some jitter later
    - packets can be corrupted (either the header or the data portion)
-   or lost, according to user-defined probabilities
+   or lost, according to user-defined probabilities, in bursts or as in
+   a recorded trace
    - packets will be delivered in the order in which they were sent
    (although some can be lost).
 
@@ -33,22 +36,122 @@
    soon as n packets are sent.
    - fixed C style to adhere to current programming style
 
+   Build with the random number generators and POSIX threads, e.g.
+     gcc -ansi -pedantic -Wall -pthread emulator.c rng.c bintrace.c hist.c checksum.c rto.c msgq.c gbn.c -o gbn -lm
+   and for benchmarks, with every trace statement compiled out,
+     gcc -ansi -pedantic -Wall -pthread -O2 -DTRACE_MAX=0 emulator.c rng.c bintrace.c hist.c checksum.c rto.c msgq.c gbn.c -o gbn -lm
+
    ********************************************************************* */
+#define _POSIX_C_SOURCE 200112L   /* threads and sysconf for --jobs */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "emulator.h"
+#include "bintrace.h"
+#include "checksum.h"
+#include "msgq.h"
 #include "gbn.h"
 
 struct event {
   float evtime;           /* event time */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
-  struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  int flow;               /* flow of the entity */
+  struct pkt pkt;         /* packet (if any) assoc w/ this event */
+  unsigned long evseq;    /* insertion order, breaks ties between equal times */
+  int heapidx;            /* current position of this event in evheap */
+  struct event *nextfree; /* next unused event while on the free list */
+};
+
+/* a payload buffer, followed in memory by its net->pbufsize data bytes.
+   Buffers are recycled through a free list once their last reference is
+   dropped, and all of them are released together when the run ends */
+struct pbuf {
+  int refs;               /* references held, 0 while on the free list */
+  char *data;
+  struct pbuf *next;      /* next buffer allocated by the sim */
+  struct pbuf *nextfree;  /* next unused buffer while on the free list */
+};
+
+/* events are carved out of slabs and recycled through a free list, so
+   the main loop does not go through malloc/free for every packet, timer
+   and arrival.  All slabs are released together when the run ends */
+#define EVSLAB 256        /* number of events allocated at a time */
+
+struct evslab {
+  struct evslab *next;
+  struct event events[EVSLAB];
+};
+
+/* packets waiting for a link with a bandwidth, and the one it is sending:
+   the times at which they finish transmission, oldest first, kept in a
+   growing ring */
+struct txqueue {
+  double *finish;
+  int head;               /* oldest packet */
+  int count;
+  int capacity;
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* the network of a simulation: its flows, and the clock, event list,
+   payload buffers and channel they share.  Packets of every flow queue
+   on the same channel in each direction, the bottleneck of the network */
+struct net {
+  struct simparams params;
+  int trace;              /* TRACE of the emulator itself */
+  int quiet;              /* suppress warnings, set for sweep points */
+  struct rng rng;         /* random number generator of this run */
+  struct bintrace *bintrace; /* binary event trace, NULL if not traced */
+  float time;
+  long nevents;           /* number of events simulated */
+  struct sim *flows;      /* flow i is flows[i] */
+  int nflows;
+
+  /* the event list is a binary min-heap ordered on (evtime, evseq), so that
+     insertion and removal are O(log n) and events with equal times are
+     handled in the order in which they were scheduled */
+  struct event **evheap;
+  int evcount;            /* number of events in the heap */
+  int evcapacity;         /* number of slots allocated for evheap */
+  unsigned long evseqnext; /* sequence number for the next event */
+  struct evslab *evslabs; /* every slab of events allocated so far */
+  struct event *evfree;   /* events ready for reuse */
+
+  struct pbuf *pbufs;     /* every payload buffer allocated so far */
+  struct pbuf *pbuffree;  /* payload buffers ready for reuse */
+  int pbufsize;           /* size of every payload buffer */
+
+  /* end-to-end latency of the messages of every flow, in 1/LATENCY_SCALE
+     time units */
+  struct hist latency;
+
+  /* latest arrival time scheduled on the channel towards A and towards B.
+     The medium can not reorder, so new packets are scheduled after it */
+  float channeltail[2];
+  int inflight[2];        /* packets on the channel towards A and towards B */
+  int queuemax[2];        /* the most there have been queued at once */
+
+  /* with a bandwidth, each direction is a link that sends one packet at
+     a time.  Packets queue for it in txq, and are counted by linkqueue */
+  struct txqueue txq[2];
+  double linkfree[2];     /* when the link finishes its last transmission */
+  double busy[2];         /* time the link has spent transmitting */
+
+  /* RED state of the queue in each direction */
+  double redavg[2];       /* moving average of the queue length */
+  int redcount[2];        /* packets queued since the last drop, -1 below the threshold */
+  float idlesince[2];     /* when the channel last emptied, without a bandwidth */
+
+  /* state of the loss model in each direction */
+  int gebad[2];           /* Gilbert-Elliott: whether the channel is in the bad state */
+  long losspos[2];        /* next packet of the loss trace */
+  int lastlost[2];        /* whether the last packet was lost, to count bursts */
+};
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
@@ -58,357 +161,1250 @@ struct event *evlist = NULL;   /* the event list */
 #define  OFF             0
 #define  ON              1
 
-int TRACE = 3;
-
-/* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
-
-/* statistics updated by emulator */
-static int packets_lost;  
-static int packets_corrupt;
-static int packets_sent;
-static int packets_timeout;
-static int messages_delivered;
-
-static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
-static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
-static float lossprob;            /* probability that a packet is dropped  */
-static float corruptprob;   /* probability that one bit is packet is flipped */
-static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
-static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
 
 /****************************************************************************/
-/* jimsrand(): return a double in range [0,1].  The routine below is used to */
-/* isolate all random number generation in one location.  We assume that the*/
-/* system-supplied rand() function return an int in therange [0,mmm]        */
+/* jimsrand(): return a double in range [0,1).  The routines below are used */
+/* to isolate all random number generation in one location.  Every sim has  */
+/* its own generator (see rng.c), so runs are reproducible on any machine   */
+/* and simulations on different threads do not share any state.             */
 /****************************************************************************/
-double jimsrand(void) 
+double jimsrand(struct sim *sim) 
 {
-  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
-  if (TRACE > 3)
+  x = rng_uniform(&sim->net->rng);  /* x is uniform in [0,1) */
+  if (TRACING(sim, 4))
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
   return(x);
 }  
 
+/* draw n random numbers at once, for decisions that are always made together */
+static void jimsrand_batch(struct sim *sim, double *x, int n)
+{
+  int i;
+
+  rng_uniforms(&sim->net->rng, x, n);
+  if (TRACING(sim, 4))
+    for (i = 0; i < n; i++)
+      printf("RANDOM NUMBER GENERAION CALLED: %f\n", x[i]);
+}
+
 /********************* EVENT HANDLINE ROUTINES *******/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-void insertevent(struct event *p)
+/* take an event from the free list, allocating a new slab if it is empty */
+static struct event *newevent(struct net *net)
 {
-  struct event *q,*qold;
+  struct evslab *slab;
+  struct event *p;
+  int i;
 
-  if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
-  }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
-  }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
+  if (net->evfree == NULL) {
+    slab = malloc(sizeof(struct evslab));
+    if (slab == NULL) {
+      printf("memory allocation for event failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
+    slab->next = net->evslabs;
+    net->evslabs = slab;
+    for (i = EVSLAB-1; i >= 0; i--) {
+      slab->events[i].nextfree = net->evfree;
+      net->evfree = &slab->events[i];
     }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+  }
+  p = net->evfree;
+  net->evfree = p->nextfree;
+  return p;
+}
+
+/* give an event back to the free list */
+static void freeevent(struct net *net, struct event *p)
+{
+  p->nextfree = net->evfree;
+  net->evfree = p;
+}
+
+/* release every slab, the event list must no longer be used */
+static void freeevents(struct net *net)
+{
+  struct evslab *slab;
+
+  while (net->evslabs != NULL) {
+    slab = net->evslabs;
+    net->evslabs = slab->next;
+    free(slab);
+  }
+  net->evfree = NULL;
+  free(net->evheap);
+  net->evheap = NULL;
+  net->evcount = net->evcapacity = 0;
+}
+
+/* returns true if event a must be handled before event b */
+static int evbefore(struct event *a, struct event *b)
+{
+  if (a->evtime != b->evtime)
+    return a->evtime < b->evtime;
+  return a->evseq < b->evseq;
+}
+
+static void evplace(struct net *net, struct event *p, int i)
+{
+  net->evheap[i] = p;
+  p->heapidx = i;
+}
+
+static void evsiftup(struct net *net, int i)
+{
+  struct event *p = net->evheap[i];
+  int parent;
+
+  while (i > 0) {
+    parent = (i-1) / 2;
+    if (!evbefore(p, net->evheap[parent]))
+      break;
+    evplace(net, net->evheap[parent], i);
+    i = parent;
+  }
+  evplace(net, p, i);
+}
+
+static void evsiftdown(struct net *net, int i)
+{
+  struct event *p = net->evheap[i];
+  int child;
+
+  while ((child = 2*i + 1) < net->evcount) {
+    if (child+1 < net->evcount && evbefore(net->evheap[child+1], net->evheap[child]))
+      child++;
+    if (!evbefore(net->evheap[child], p))
+      break;
+    evplace(net, net->evheap[child], i);
+    i = child;
+  }
+  evplace(net, p, i);
+}
+
+void insertevent(struct net *net, struct event *p)
+{
+  struct event **grown;
+
+  if (TRACING(net, 3)) {
+    printf("            INSERTEVENT: time is %f\n",net->time);
+    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  }
+  if (net->evcount == net->evcapacity) {   /* heap is full, double its size */
+    net->evcapacity = net->evcapacity ? 2*net->evcapacity : 64;
+    grown = realloc(net->evheap, net->evcapacity * sizeof(struct event *));
+    if (grown == NULL) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
     }
+    net->evheap = grown;
   }
+  p->evseq = net->evseqnext++;
+  evplace(net, p, net->evcount++);
+  evsiftup(net, p->heapidx);
+}
+
+/* remove an event from anywhere in the event list */
+static void removeevent(struct net *net, struct event *p)
+{
+  int i = p->heapidx;
+  struct event *last;
+
+  last = net->evheap[--net->evcount];
+  if (last == p)
+    return;
+  evplace(net, last, i);
+  if (i > 0 && evbefore(last, net->evheap[(i-1) / 2]))
+    evsiftup(net, i);
+  else
+    evsiftdown(net, i);
 }
 
-void generate_next_arrival(void)
+/* remove and return the next event to simulate, NULL if there is none */
+static struct event *popevent(struct net *net)
+{
+  struct event *p;
+
+  if (net->evcount == 0)
+    return NULL;
+  p = net->evheap[0];
+  removeevent(net, p);
+  return p;
+}
+
+void generate_next_arrival(struct sim *sim)
 {
   double x;
   struct event *evptr;
 
-  if (TRACE>2)
+  if (TRACING(sim, 3))
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+  x = sim->params.lambda*jimsrand(sim)*2;  /* x is uniform on [0,2*lambda] */
   /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + x;
+  evptr = newevent(sim->net);
+  evptr->evtime =  sim->net->time + x;
   evptr->evtype =  FROM_LAYER5;
-  if (BIDIRECTIONAL && (jimsrand()>0.5) )
+  evptr->flow = sim->flow;
+  if (sim->params.duplex && (jimsrand(sim)>0.5) )
     evptr->eventity = B;
   else
     evptr->eventity = A;
-  insertevent(evptr);
+  insertevent(sim->net, evptr);
 } 
 
-void printevlist(void)
+void printevlist(struct net *net)
 {
   struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  int i;
+  printf("--------------\nEvent List Follows (heap order):\n");
+  for (i = 0; i < net->evcount; i++) {
+    q = net->evheap[i];
+    printf("Event time: %f, type: %d entity: %d flow: %d\n",q->evtime,q->evtype,q->eventity,q->flow);
   }
   printf("--------------\n");
 }
 
-void init(void)                         /* initialize the simulator */
+/********************* PAYLOAD BUFFERS *************/
+/*  A payload is written once, into a buffer shared */
+/*  by every packet carrying it, and is freed when  */
+/*  the last reference to it is dropped.            */
+/*****************************************************/
+
+/* a buffer with a single reference, held by the caller */
+static struct pbuf *newpbuf(struct sim *sim)
+{
+  struct net *net = sim->net;
+  struct pbuf *b;
+
+  if (net->pbuffree != NULL) {
+    b = net->pbuffree;
+    net->pbuffree = b->nextfree;
+  }
+  else {
+    b = malloc(sizeof(struct pbuf) + net->pbufsize);
+    if (b == NULL) {
+      printf("memory allocation for payload failed.");
+      exit(EXIT_FAILURE);
+    }
+    b->data = (char *)(b + 1);
+    b->next = net->pbufs;
+    net->pbufs = b;
+  }
+  b->refs = 1;
+  return b;
+}
+
+void pbuf_hold(struct pbuf *b)
+{
+  if (b != NULL)
+    b->refs++;
+}
+
+void pbuf_release(struct sim *sim, struct pbuf *b)
+{
+  if (b == NULL)
+    return;
+  if (b->refs <= 0) {
+    printf("INTERNAL PANIC: payload buffer released too often \n");
+    exit(EXIT_FAILURE);
+  }
+  if (--b->refs == 0) {
+    b->nextfree = sim->net->pbuffree;
+    sim->net->pbuffree = b;
+  }
+}
+
+/* free every buffer, whether or not references are still held */
+static void freepbufs(struct net *net)
+{
+  struct pbuf *b;
+
+  while (net->pbufs != NULL) {
+    b = net->pbufs;
+    net->pbufs = b->next;
+    free(b);
+  }
+  net->pbuffree = NULL;
+}
+
+/********************* SIMULATION PARAMETERS *******/
+/*  Parameters can be given on the command line as   */
+/*  --name value (or --name=value), read from a      */
+/*  config file of "name = value" lines, or entered  */
+/*  at the prompts when no arguments are given.      */
+/*  A value of the form from:to:step turns the run   */
+/*  into a sweep over every combination of values.   */
+/*****************************************************/
+
+#define  OPT_INT         0
+#define  OPT_UINT        1
+#define  OPT_FLOAT       2
+
+struct simoption {
+  const char *name;       /* name on the command line and in config files */
+  int type;               /* OPT_INT, OPT_UINT or OPT_FLOAT */
+  size_t offset;          /* offset of the parameter in struct simparams */
+  const char *help;
+  double from, to, step;  /* range of values swept, from == to if not swept */
+  int npoints;            /* number of values in the range */
+};
+
+#define PARAM(field) offsetof(struct simparams, field)
+#define NOSWEEP 0.0, 0.0, 0.0, 0   /* no range until setoption sets one */
+
+static struct simoption options[] = {
+  {"messages",  OPT_INT,   PARAM(nsimmax),          "number of messages to simulate, in every flow", NOSWEEP},
+  {"loss",      OPT_FLOAT, PARAM(lossprob),         "packet loss probability", NOSWEEP},
+  {"corrupt",   OPT_FLOAT, PARAM(corruptprob),      "packet corruption probability", NOSWEEP},
+  {"direction", OPT_INT,   PARAM(corruptdirection), "loss/corruption direction: 0 A->B, 1 A<-B, 2 both", NOSWEEP},
+  {"lambda",    OPT_FLOAT, PARAM(lambda),           "average time between messages from sender's layer5", NOSWEEP},
+  {"trace",     OPT_INT,   PARAM(trace),            "trace level", NOSWEEP},
+  {"seed",      OPT_UINT,  PARAM(seed),             "random number generator seed", NOSWEEP},
+  {"stream",    OPT_UINT,  PARAM(stream),           "random number stream, for independent replications", NOSWEEP},
+  {"rng",       OPT_INT,   PARAM(rng),              "random number generator: 0 xoshiro256**, 1 pcg32", NOSWEEP},
+  {"mtu",       OPT_INT,   PARAM(mtu),              "largest packet payload in bytes, at most 65536", NOSWEEP},
+  {"msgsize",   OPT_INT,   PARAM(msgsize),          "size of the messages from layer5 in bytes", NOSWEEP},
+  {"checksum",  OPT_INT,   PARAM(checksum),         "packet checksum: 0 sum, 1 internet (RFC 1071), 2 crc32c", NOSWEEP},
+  {"window",    OPT_INT,   PARAM(window),           "send window size in packets", NOSWEEP},
+  {"seqspace",  OPT_INT,   PARAM(seqspace),         "number of sequence numbers [default: the least the protocol allows]", NOSWEEP},
+  {"rtt",       OPT_FLOAT, PARAM(rtt),              "round trip time, the retransmission timeout", NOSWEEP},
+  {"rto",       OPT_INT,   PARAM(rto),              "retransmission timeout: 0 fixed at rtt, 1 adaptive (Jacobson/Karels)", NOSWEEP},
+  {"dupacks",   OPT_INT,   PARAM(dupacks),          "duplicate ACKs that trigger a fast retransmit, 0 = never", NOSWEEP},
+  {"sack",      OPT_INT,   PARAM(sack),             "ACKs: 0 one per packet, 1 cumulative with a selective ACK bitmap", NOSWEEP},
+  {"ackevery",  OPT_INT,   PARAM(ackevery),         "cumulative ACKs: B ACKs every n-th packet received in order", NOSWEEP},
+  {"ackdelay",  OPT_FLOAT, PARAM(ackdelay),         "longest time B delays an ACK, with ackevery above 1", NOSWEEP},
+  {"sendqueue", OPT_INT,   PARAM(sendqueue),        "messages A queues while its window is full, 0 = drop them", NOSWEEP},
+  {"duplex",    OPT_INT,   PARAM(duplex),           "1: layer5 gives messages to both A and B, ACKs ride on data", NOSWEEP},
+  {"flows",     OPT_INT,   PARAM(flows),            "number of sender/receiver pairs sharing the channel", NOSWEEP},
+  {"linkqueue", OPT_INT,   PARAM(linkqueue),        "packets the channel holds in each direction, 0 = no limit", NOSWEEP},
+  {"bandwidth", OPT_FLOAT, PARAM(bandwidth),        "link rate in bytes per time unit, 0 = a delay of 1 to 10 time units", NOSWEEP},
+  {"propdelay", OPT_FLOAT, PARAM(propdelay),        "propagation delay of the link, with a bandwidth", NOSWEEP},
+  {"jitter",    OPT_FLOAT, PARAM(jitter),           "mean random delay added to the propagation delay", NOSWEEP},
+  {"delaydist", OPT_INT,   PARAM(delaydist),        "distribution of the jitter: 0 uniform in [0, 2*jitter], 1 exponential", NOSWEEP},
+  {"red",       OPT_FLOAT, PARAM(red),              "RED drop probability at 3/4 of linkqueue, 0 = drop-tail", NOSWEEP},
+  {"lossmodel", OPT_INT,   PARAM(lossmodel),        "packet loss: 0 independent, 1 Gilbert-Elliott bursts, 2 replay --losstrace", NOSWEEP},
+  {"pbad",      OPT_FLOAT, PARAM(pbad),             "Gilbert-Elliott: probability of entering the bad state, per packet", NOSWEEP},
+  {"pgood",     OPT_FLOAT, PARAM(pgood),            "Gilbert-Elliott: probability of leaving the bad state, per packet", NOSWEEP},
+  {"badloss",   OPT_FLOAT, PARAM(badloss),          "Gilbert-Elliott: loss probability in the bad state (loss in the good)", NOSWEEP},
+  {"flipbits",  OPT_INT,   PARAM(flipbits),         "bits a corruption flips anywhere in the packet, 0 = one field", NOSWEEP}
+};
+#define NOPTIONS ((int)(sizeof(options) / sizeof(options[0])))
+
+/* parameters given on the command line, in config files or at the prompts */
+static struct simparams params = {
+  1000,                   /* nsimmax */
+  0.0,                    /* lossprob */
+  0.0,                    /* corruptprob */
+  2,                      /* corruptdirection */
+  10.0,                   /* lambda */
+  0,                      /* trace */
+  9999,                   /* seed */
+  0,                      /* stream */
+  RNG_XOSHIRO,            /* rng */
+  20,                     /* mtu */
+  20,                     /* msgsize */
+  CKSUM_SUM,              /* checksum */
+  6,                      /* window */
+  0,                      /* seqspace */
+  16.0,                   /* rtt */
+  0,                      /* rto */
+  0,                      /* dupacks */
+  0,                      /* sack */
+  1,                      /* ackevery */
+  2.0,                    /* ackdelay */
+  0,                      /* sendqueue */
+  0,                      /* duplex */
+  1,                      /* flows */
+  0,                      /* linkqueue */
+  0.0,                    /* bandwidth */
+  5.0,                    /* propdelay */
+  0.0,                    /* jitter */
+  DELAY_UNIFORM,          /* delaydist */
+  0.0,                    /* red */
+  LOSS_BERNOULLI,         /* lossmodel */
+  0.01,                   /* pbad */
+  0.25,                   /* pgood */
+  1.0,                    /* badloss */
+  0                       /* flipbits */
+};
+
+static int jobs = 0;              /* sweep worker threads, 0 = one per cpu */
+static const char *csvfile = NULL; /* sweep results file, NULL = stdout */
+static const char *bintracefile = NULL; /* binary trace of a single run, NULL = none */
+static const char *losstracefile = NULL; /* losses replayed with lossmodel 2 */
+static char *losstrace = NULL;    /* '1' for every packet lost in the trace, '0' if not */
+static long losstracelen = 0;
+static const char *bench = NULL;  /* benchmark to run instead of a simulation */
+
+/* set the parameter of opt in p to the idx'th value of its range */
+static void setpoint(struct simoption *opt, int idx, struct simparams *p)
+{
+  double d = opt->from + idx * opt->step;
+  void *value = (char *)p + opt->offset;
+
+  if (idx == opt->npoints-1)
+    d = opt->to;
+  switch (opt->type) {
+  case OPT_INT:
+    *(int *)value = (int)d;
+    break;
+  case OPT_UINT:
+    *(unsigned int *)value = (unsigned int)d;
+    break;
+  default:
+    *(float *)value = (float)d;
+    break;
+  }
+}
+
+static void usage(const char *prog)
 {
-  float sum, avg;
   int i;
 
-  printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
+  printf("usage: %s [--config file] [--name value ...]\n", prog);
+  printf("with no arguments the parameters are read from the prompts.\n");
+  printf("  --config file   read \"name = value\" lines from file\n");
+  printf("  --bintrace file write a binary event trace to file, see tracedump.c\n");
+  printf("  --losstrace file replay the 0s and 1s (lost) in file, with lossmodel 2\n");
+  printf("  --bench checksum measure the speed and detection rates of the checksums\n");
+  for (i = 0; i < NOPTIONS; i++)
+    printf("  --%-13s %s\n", options[i].name, options[i].help);
+  printf("any parameter may be given as from:to:step to sweep over a range:\n");
+  printf("  --jobs n        number of sweep workers [default: one per cpu]\n");
+  printf("  --csv file      write the sweep results to file [default: stdout]\n");
+}
+
+/* set the named parameter from its text value, returns 0 on error */
+static int setoption(const char *name, const char *text)
+{
+  struct simoption *opt = NULL;
+  char *end;
+  int i;
+
+  for (i = 0; i < NOPTIONS; i++)
+    if (strcmp(options[i].name, name) == 0)
+      opt = &options[i];
+  if (opt == NULL) {
+    printf("unknown parameter: %s\n", name);
+    return 0;
+  }
+  opt->from = strtod(text, &end);
+  opt->to = opt->from;
+  opt->step = 1.0;
+  if (end != text && *end == ':') {
+    text = end + 1;
+    opt->to = strtod(text, &end);
+    if (end != text && *end == ':') {
+      text = end + 1;
+      opt->step = strtod(text, &end);
+    }
+  }
+  if (end == text || *end != '\0' || opt->to < opt->from || opt->step <= 0.0) {
+    printf("invalid value for %s: %s\n", name, text);
+    return 0;
+  }
+  opt->npoints = (int)((opt->to - opt->from) / opt->step + 1e-9) + 1;
+  if (opt->from + (opt->npoints-1) * opt->step < opt->to - 1e-9)
+    opt->npoints++;           /* always include the end of the range */
+  setpoint(opt, 0, &params);
+  return 1;
+}
+
+/* read "name = value" lines, blank lines and lines starting with # are
+   ignored. Returns 0 on error */
+static int readconfig(const char *filename)
+{
+  FILE *fp;
+  char line[256], name[64], text[128];
+  char *comment;
+  int lineno = 0;
+  int n;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    printf("unable to open config file %s\n", filename);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    if ((comment = strchr(line, '#')) != NULL)
+      *comment = '\0';
+    n = sscanf(line, " %63[^ \t\n=] = %127s", name, text);
+    if (n == EOF)
+      continue;                 /* blank line or comment */
+    if (n != 2 || !setoption(name, text)) {
+      printf("%s:%d: invalid line\n", filename, lineno);
+      fclose(fp);
+      return 0;
+    }
+  }
+  fclose(fp);
+  return 1;
+}
+
+/* read the losses to replay from filename: a 1 for every packet lost and
+   a 0 for every packet delivered, anything else is ignored */
+static void readlosstrace(const char *filename)
+{
+  FILE *fp;
+  char *grown;
+  long capacity = 0;
+  int c;
+
+  if ((fp = fopen(filename, "r")) == NULL) {
+    printf("unable to open %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  while ((c = getc(fp)) != EOF) {
+    if (c != '0' && c != '1')
+      continue;
+    if (losstracelen == capacity) {
+      capacity = capacity ? 2*capacity : 4096;
+      grown = realloc(losstrace, capacity);
+      if (grown == NULL) {
+        printf("memory allocation for the loss trace failed.");
+        exit(EXIT_FAILURE);
+      }
+      losstrace = grown;
+    }
+    losstrace[losstracelen++] = (char)c;
+  }
+  fclose(fp);
+  if (losstracelen == 0) {
+    printf("%s holds no losses to replay\n", filename);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* apply the command line, later settings override earlier ones */
+static void parseargs(int argc, char **argv)
+{
+  char name[64];
+  const char *arg, *text;
+  size_t len;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    arg = argv[i];
+    if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    }
+    if (strncmp(arg, "--", 2) != 0) {
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    arg += 2;
+    text = strchr(arg, '=');
+    len = text ? (size_t)(text - arg) : strlen(arg);
+    if (len >= sizeof(name)) {
+      printf("unknown parameter: %s\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(name, arg, len);
+    name[len] = '\0';
+    if (text != NULL)
+      text++;
+    else if (i+1 < argc)
+      text = argv[++i];
+    else {
+      printf("missing value for --%s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    if (strcmp(name, "jobs") == 0)
+      jobs = atoi(text);
+    else if (strcmp(name, "csv") == 0)
+      csvfile = text;
+    else if (strcmp(name, "bintrace") == 0)
+      bintracefile = text;
+    else if (strcmp(name, "losstrace") == 0)
+      losstracefile = text;
+    else if (strcmp(name, "bench") == 0)
+      bench = text;
+    else if (strcmp(name, "config") == 0 ? !readconfig(text) : !setoption(name, text))
+      exit(EXIT_FAILURE);
+  }
+}
+
+/* ask for the parameters at the prompts */
+static void askparams(void)
+{
   printf("Enter the number of messages to simulate: ");
-  scanf("%d",&nsimmax);
+  scanf("%d",&params.nsimmax);
   printf("Enter  packet loss probability [enter 0.0 for no loss]:");
-  scanf("%f",&lossprob);
+  scanf("%f",&params.lossprob);
   printf("Enter packet corruption probability [0.0 for no corruption]:");
-  scanf("%f",&corruptprob);
-  if (lossprob != 0.0 || corruptprob != 0.0) {
+  scanf("%f",&params.corruptprob);
+  params.corruptdirection = 0;
+  if (params.lossprob != 0.0 || params.corruptprob != 0.0) {
     printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
-    scanf("%d",&corruptdirection);
+    scanf("%d",&params.corruptdirection);
   }
   printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
-  scanf("%f",&lambda);
+  scanf("%f",&params.lambda);
   printf("Enter TRACE:");
-  scanf("%d",&TRACE);
+  scanf("%d",&params.trace);
+}
 
+/* the sequence space of a run with parameters p */
+static int seqspaceof(const struct simparams *p)
+{
+  return p->seqspace != 0 ? p->seqspace : proto_minseqspace(p);
+}
 
-  srand(9999);              /* init random number generator */
+static void checkparams(const struct simparams *p)
+{
+  if (p->nsimmax < 0 || p->lossprob < 0.0 || p->lossprob > 1.0 || p->corruptprob < 0.0 || p->corruptprob > 1.0
+      || p->corruptdirection < 0 || p->corruptdirection > 2 || p->lambda <= 0.0 || p->trace < 0
+      || (p->rng != RNG_XOSHIRO && p->rng != RNG_PCG) || p->mtu < 1 || p->mtu > MAXMTU || p->msgsize < 1
+      || p->checksum < CKSUM_SUM || p->checksum > CKSUM_CRC32C
+      || p->window < 1 || p->window >= CORRUPTSEQ || p->seqspace < 0 || p->seqspace > CORRUPTSEQ || p->rtt <= 0.0
+      || p->rto < 0 || p->rto > 1 || p->dupacks < 0 || p->sack < 0 || p->sack > 1
+      || p->ackevery < 1 || p->ackdelay <= 0.0 || p->sendqueue < 0
+      || p->duplex < 0 || p->duplex > 1 || p->flows < 1 || p->linkqueue < 0
+      || p->bandwidth < 0.0 || p->propdelay < 0.0 || p->jitter < 0.0
+      || (p->delaydist != DELAY_UNIFORM && p->delaydist != DELAY_EXP) || p->red < 0.0 || p->red > 1.0
+      || p->lossmodel < LOSS_BERNOULLI || p->lossmodel > LOSS_TRACE || p->pbad < 0.0 || p->pbad > 1.0
+      || p->pgood < 0.0 || p->pgood > 1.0 || p->badloss < 0.0 || p->badloss > 1.0 || p->flipbits < 0) {
+    printf("invalid simulation parameters: messages %d, loss %f, corrupt %f, direction %d, lambda %f, trace %d, rng %d, mtu %d, msgsize %d, checksum %d, window %d, seqspace %d, rtt %f, rto %d, dupacks %d, sack %d, ackevery %d, ackdelay %f, sendqueue %d, duplex %d, flows %d, linkqueue %d, bandwidth %f, propdelay %f, jitter %f, delaydist %d, red %f, lossmodel %d, pbad %f, pgood %f, badloss %f, flipbits %d\n",
+           p->nsimmax, p->lossprob, p->corruptprob, p->corruptdirection, p->lambda, p->trace, p->rng, p->mtu, p->msgsize, p->checksum,
+           p->window, p->seqspace, p->rtt, p->rto, p->dupacks, p->sack, p->ackevery, p->ackdelay, p->sendqueue, p->duplex,
+           p->flows, p->linkqueue, p->bandwidth, p->propdelay, p->jitter, p->delaydist, p->red,
+           p->lossmodel, p->pbad, p->pgood, p->badloss, p->flipbits);
+    exit(EXIT_FAILURE);
+  }
+  if (p->lossmodel == LOSS_TRACE && losstrace == NULL) {
+    printf("lossmodel %d replays a trace, give it with --losstrace\n", LOSS_TRACE);
+    exit(EXIT_FAILURE);
+  }
+  if (p->duplex && !proto_duplex()) {
+    printf("this protocol only sends data from A to B, set duplex 0\n");
+    exit(EXIT_FAILURE);
+  }
+  if (p->red > 0.0 && p->linkqueue == 0) {
+    printf("RED needs a channel queue, set linkqueue\n");
+    exit(EXIT_FAILURE);
+  }
+  /* a message is only queued whole, so a shorter queue would turn every
+     message away, even with the window empty */
+  if (p->sendqueue > 0 && p->sendqueue < (p->msgsize + p->mtu - 1) / p->mtu) {
+    printf("a message of %d bytes is %d segments of mtu %d, so sendqueue must be 0 or at least %d, not %d\n",
+           p->msgsize, (p->msgsize + p->mtu - 1) / p->mtu, p->mtu, (p->msgsize + p->mtu - 1) / p->mtu, p->sendqueue);
+    exit(EXIT_FAILURE);
+  }
+  if (seqspaceof(p) < proto_minseqspace(p) || seqspaceof(p) > CORRUPTSEQ) {
+    printf("a window of %d needs a sequence space of %d to %d, not %d\n",
+           p->window, proto_minseqspace(p), CORRUPTSEQ, seqspaceof(p));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* create a simulation with the given parameters, a network with its flows */
+static struct net *newnet(const struct simparams *params)
+{
+  struct net *net;
+  struct sim *sim;
+  int i;
+
+  net = calloc(1, sizeof(struct net));
+  if (net != NULL)
+    net->flows = calloc(params->flows, sizeof(struct sim));
+  if (net == NULL || net->flows == NULL) {
+    printf("memory allocation for simulation failed.");
+    exit(EXIT_FAILURE);
+  }
+  net->params = *params;
+  net->trace = params->trace;
+  net->nflows = params->flows;
+  /* a buffer holds a whole message, or a packet copied for corruption */
+  net->pbufsize = params->msgsize > params->mtu ? params->msgsize : params->mtu;
+
+  for (i = 0; i < net->nflows; i++) {
+    sim = &net->flows[i];
+    sim->net = net;
+    sim->flow = i;
+    sim->params = *params;
+    sim->trace = params->trace;
+    sim->mtu = params->mtu;
+    sim->checksum = params->checksum;
+    sim->windowsize = params->window;
+    sim->seqspace = seqspaceof(params);
+    sim->rtt = params->rtt;
+    sim->adaptiverto = params->rto;
+    sim->dupacks = params->dupacks;
+    sim->sack = params->sack;
+    sim->ackevery = params->ackevery;
+    sim->ackdelay = params->ackdelay;
+    sim->duplex = params->duplex;
+    sim->sendq[A] = msgq_alloc(params->sendqueue);
+    if (sim->duplex)
+      sim->sendq[B] = msgq_alloc(params->sendqueue);
+    sim->proto = proto_alloc(sim);
+  }
+  return net;
+}
+
+static void freenet(struct net *net)
+{
+  struct sim *sim;
+  int i;
+
+  freeevents(net);
+  for (i = 0; i < net->nflows; i++) {
+    sim = &net->flows[i];
+    free(sim->pending[A].segs);
+    free(sim->pending[B].segs);
+    proto_free(sim->proto);
+    msgq_free(sim->sendq[A]);
+    if (sim->sendq[B] != NULL)
+      msgq_free(sim->sendq[B]);
+  }
+  free(net->txq[A].finish);
+  free(net->txq[B].finish);
+  freepbufs(net);
+  free(net->flows);
+  free(net);
+}
+
+void init(struct net *net)              /* initialize the simulator */
+{
+  struct sim *sim;
+  float sum, avg;
+  int i;
+
+  /* init random number generator */
+  rng_seed(&net->rng, net->params.rng, net->params.seed, net->params.stream);
   sum = 0.0;                /* test random number generator for students */
   for (i=0; i<1000; i++)
-    sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
+    sum+=jimsrand(&net->flows[0]);    /* jimsrand() should be uniform in [0,1] */
   avg = sum/1000.0;
   if (avg < 0.25 || avg > 0.75) {
     printf("It is likely that random number generation on your machine\n" ); 
     printf("is different from what this emulator expects.  Please take\n");
-    printf("a look at the routine jimsrand() in the emulator code. Sorry. \n");
+    printf("a look at the generators in rng.c. Sorry. \n");
     exit(EXIT_FAILURE);
   }
 
-  /* initialise statistics */
-  window_full = 0;
-  total_ACKs_received = 0;
-  packets_resent = 0;
-  new_ACKs = 0;
-  packets_received = 0;
-  packets_lost = 0;  
-  packets_corrupt = 0;
-  packets_sent = 0;
-  packets_timeout = 0;
-  messages_delivered = 0;
+  hist_init(&net->latency);
+  net->channeltail[A] = 0.0;
+  net->channeltail[B] = 0.0;
+  net->inflight[A] = net->inflight[B] = 0;
+  net->queuemax[A] = net->queuemax[B] = 0;
+  for (i = A; i <= B; i++) {
+    net->txq[i].count = 0;
+    net->linkfree[i] = 0.0;
+    net->busy[i] = 0.0;
+    net->redavg[i] = 0.0;
+    net->redcount[i] = -1;
+    net->idlesince[i] = 0.0;
+    net->gebad[i] = 0;
+    net->losspos[i] = 0;
+    net->lastlost[i] = 0;
+  }
+  net->time=0.0;                    /* initialize time to 0.0 */
+
+  /* initialise the statistics of every flow, each starts with an arrival */
+  for (i = 0; i < net->nflows; i++) {
+    sim = &net->flows[i];
+    sim->window_full = 0;
+    sim->total_ACKs_received = 0;
+    sim->packets_resent = 0;
+    sim->fast_retransmits = 0;
+    sim->new_ACKs = 0;
+    sim->packets_received = 0;
+    sim->messages_delivered = 0;
+
+    sim->ntolayer3 = 0;
+    sim->ntolayer3B = 0;
+    sim->nlost = 0;
+    sim->ncorrupt = 0;
+    sim->nlinkdrops = 0;
+    sim->nreddrops = 0;
+    sim->nlossbursts = 0;
 
-  ntolayer3 = 0;
-  nlost = 0;
-  ncorrupt = 0;
+    sim->bytes_delivered = 0.0;
+    sim->pending[A].count = 0;
+    sim->pending[B].count = 0;
+    sim->latencysum = 0.0;
+    sim->nlatency = 0;
+
+    generate_next_arrival(sim);     /* initialize event list */
+  }
+}
+
+/* a segment of a message generated at time t has been accepted by entity from */
+static void pushpending(struct sim *sim, int from, float t, int last)
+{
+  struct pendingsegs *q = &sim->pending[from];
+  struct pendingseg *grown;
+  int i;
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  if (q->count == q->capacity) {   /* ring is full, double its size */
+    grown = malloc((q->capacity ? 2*q->capacity : 64) * sizeof(struct pendingseg));
+    if (grown == NULL) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < q->count; i++)
+      grown[i] = q->segs[(q->head+i) % q->capacity];
+    free(q->segs);
+    q->segs = grown;
+    q->head = 0;
+    q->capacity = q->capacity ? 2*q->capacity : 64;
+  }
+  q->segs[(q->head+q->count) % q->capacity].time = t;
+  q->segs[(q->head+q->count) % q->capacity].last = last;
+  q->count++;
+}
+
+/* the oldest segment accepted by entity from has been delivered.  Returns
+   whether that completes a message */
+static int poppending(struct sim *sim, int from)
+{
+  struct pendingsegs *q = &sim->pending[from];
+  int last;
+
+  if (q->count == 0)     /* more deliveries than segments, nothing to match */
+    return 1;
+  last = q->segs[q->head].last;
+  if (last) {
+    hist_add(&sim->net->latency, (uint64_t)((sim->net->time - q->segs[q->head].time) * LATENCY_SCALE + 0.5));
+    sim->latencysum += sim->net->time - q->segs[q->head].time;
+    sim->nlatency++;
+  }
+  q->head = (q->head+1) % q->capacity;
+  q->count--;
+  return last;
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
 /* called by students routine to cancel a previously-started timer */
-void stoptimer(int AorB)
+void stoptimer(struct sim *sim, int AorB)
 /* A or B is trying to stop timer */
 {
   struct event *q;
 
-  if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+  if (TRACING(sim, 2))
+    printf("          STOP TIMER: stopping timer at %f\n",sim->net->time);
+  q = sim->timers[AorB];
+  if (q != NULL) {
+    if (sim->net->bintrace != NULL)
+      bintrace_record(sim->net->bintrace, sim->net->time, TR_STOPTIMER, AorB, 0, 0, 0, 0);
+    removeevent(sim->net, q);
+    freeevent(sim->net, q);
+    sim->timers[AorB] = NULL;
+    return;
+  }
+  if (!sim->net->quiet)
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
 }
 
 
-void starttimer(int AorB, double increment)
+float simtime(struct sim *sim)
+{
+  return sim->net->time;
+}
+
+void starttimer(struct sim *sim, int AorB, double increment)
 /* A or B is trying to start timer */
 {
 
-  struct event *q;
   struct event *evptr;
 
-  if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+  if (TRACING(sim, 2))
+    printf("          START TIMER: starting timer at %f\n",sim->net->time);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
+  if (sim->timers[AorB] != NULL) {
+    if (!sim->net->quiet)
       printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+    return;
+  }
  
   /* create future event for when timer goes off */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + increment;
+  evptr = newevent(sim->net);
+  evptr->evtime =  sim->net->time + increment;
   evptr->evtype =  TIMER_INTERRUPT;
    
  
   evptr->eventity = AorB;
-  insertevent(evptr);
+  evptr->flow = sim->flow;
+  insertevent(sim->net, evptr);
+  sim->timers[AorB] = evptr;
+  if (sim->net->bintrace != NULL)
+    bintrace_record(sim->net->bintrace, sim->net->time, TR_STARTTIMER, AorB, 0, 0, 0, 0);
 } 
 
 
+/* corrupt the packet p the way the medium does, u is uniform in [0,1).
+   The payload is shared with the sender, so a private copy is corrupted */
+static void corruptpacket(struct sim *sim, struct pkt *p, double u)
+{
+  struct pbuf *copy;
+
+  if (u < .75 && p->length > 0) {
+    copy = newpbuf(sim);
+    memcpy(copy->data, p->payload, p->length);
+    pbuf_release(sim, p->pbuf);
+    p->pbuf = copy;
+    p->payload = copy->data;
+    p->payload[0]='Z';            /* corrupt payload */
+  }
+  else if (u < .75)
+    p->checksum ^= 1;             /* no payload, corrupt the checksum */
+  else if (u < .875)
+    p->seqnum = CORRUPTSEQ;
+  else
+    p->acknum = CORRUPTSEQ;
+}
+
+/* corrupt the packet p by flipping n bits of its header and payload at
+   random, a bit may be hit more than once.  The length is left alone, a
+   link loses a packet whose framing is damaged */
+static void flipbits(struct sim *sim, struct pkt *p, int n)
+{
+  struct pbuf *copy;
+  int i, k;
+
+  if (p->length > 0) {
+    copy = newpbuf(sim);
+    memcpy(copy->data, p->payload, p->length);
+    pbuf_release(sim, p->pbuf);
+    p->pbuf = copy;
+    p->payload = copy->data;
+  }
+  for (k = 0; k < n; k++) {
+    i = (int)(jimsrand(sim) * (128 + 8 * p->length));
+    if (i < 32)
+      p->seqnum = (int)((unsigned int)p->seqnum ^ 1U << i);
+    else if (i < 64)
+      p->acknum = (int)((unsigned int)p->acknum ^ 1U << (i - 32));
+    else if (i < 96)
+      p->sack ^= (uint32_t)1 << (i - 64);
+    else if (i < 128)
+      p->checksum = (int)((unsigned int)p->checksum ^ 1U << (i - 96));
+    else
+      p->payload[(i - 128) / 8] ^= 1 << (i % 8);
+  }
+}
+
+/* whether the medium loses a packet on its way to entity to, u is uniform
+   in [0,1).  Runs of lost packets are counted as bursts */
+static int channellost(struct sim *sim, int to, double u)
+{
+  struct net *net = sim->net;
+  int lost;
+
+  switch (net->params.lossmodel) {
+  case LOSS_GILBERT:
+    /* the state may change before every packet, which is then lost with
+       the loss probability of the state */
+    if (jimsrand(sim) < (net->gebad[to] ? net->params.pgood : net->params.pbad))
+      net->gebad[to] = !net->gebad[to];
+    lost = u < (net->gebad[to] ? net->params.badloss : net->params.lossprob);
+    break;
+  case LOSS_TRACE:
+    lost = losstrace[net->losspos[to]++ % losstracelen] == '1';
+    break;
+  default:
+    lost = u < net->params.lossprob;
+    break;
+  }
+  if (lost && !net->lastlost[to])
+    sim->nlossbursts++;
+  net->lastlost[to] = lost;
+  return lost;
+}
+
+/* number of packets queued on the channel towards entity to.  With a
+   bandwidth these are the packets waiting for the link or being sent,
+   otherwise every packet on the channel */
+static int linkqueued(struct net *net, int to)
+{
+  struct txqueue *q = &net->txq[to];
+
+  if (net->params.bandwidth <= 0.0)
+    return net->inflight[to];
+  while (q->count > 0 && q->finish[q->head] <= net->time) {
+    q->head = (q->head+1) % q->capacity;
+    q->count--;
+  }
+  return q->count;
+}
+
+/* RED (Floyd and Jacobson): every packet that arrives at the queue
+   towards entity to updates its average length with the n packets it
+   finds there, even one that is then dropped because the queue is full.
+   While the queue is empty the average decays as if packets had kept
+   finding it empty, one per transmission */
+#define RED_WEIGHT 0.002   /* weight of the latest queue length in the average */
+
+static void redaverage(struct net *net, int to, int n)
+{
+  double slot, idle;
+
+  if (n == 0) {
+    if (net->params.bandwidth > 0.0) {
+      slot = (PKTHEADER + net->params.mtu) / net->params.bandwidth;
+      idle = net->time - net->linkfree[to];
+    }
+    else {
+      slot = 5.5;         /* mean time between arrivals on a busy channel */
+      idle = net->time - net->idlesince[to];
+    }
+    if (idle > 0.0)
+      net->redavg[to] *= pow(1.0 - RED_WEIGHT, idle / slot);
+  }
+  net->redavg[to] += RED_WEIGHT * (n - net->redavg[to]);
+}
+
+/* whether RED drops a packet that fits in the queue towards entity to.
+   Below an average queue of linkqueue/4 no packet is dropped, above
+   3*linkqueue/4 every packet is, and in between the probability grows
+   linearly to red, spread out by the number of packets since the last
+   drop */
+static int reddrop(struct sim *sim, int to)
+{
+  struct net *net = sim->net;
+  double minth = net->params.linkqueue / 4.0, maxth = 3.0 * minth;
+  double pb, pa;
+
+  if (net->redavg[to] < minth) {
+    net->redcount[to] = -1;
+    return 0;
+  }
+  if (net->redavg[to] >= maxth) {
+    net->redcount[to] = 0;
+    return 1;
+  }
+  net->redcount[to]++;
+  pb = net->params.red * (net->redavg[to] - minth) / (maxth - minth);
+  pa = net->redcount[to] * pb < 1.0 ? pb / (1.0 - net->redcount[to] * pb) : 1.0;
+  if (jimsrand(sim) < pa) {
+    net->redcount[to] = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* queue a packet of the given size for the link towards entity to, and
+   return the time at which it has been sent */
+static double transmit(struct net *net, int to, int bytes)
+{
+  struct txqueue *q = &net->txq[to];
+  double *grown, start, t;
+  int i;
+
+  if (q->count == q->capacity) {   /* ring is full, double its size */
+    grown = malloc((q->capacity ? 2*q->capacity : 64) * sizeof(double));
+    if (grown == NULL) {
+      printf("memory allocation for the link queue failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < q->count; i++)
+      grown[i] = q->finish[(q->head+i) % q->capacity];
+    free(q->finish);
+    q->finish = grown;
+    q->head = 0;
+    q->capacity = q->capacity ? 2*q->capacity : 64;
+  }
+  start = net->linkfree[to] > net->time ? net->linkfree[to] : net->time;
+  t = bytes / net->params.bandwidth;
+  q->finish[(q->head+q->count) % q->capacity] = start + t;
+  if (++q->count > net->queuemax[to])
+    net->queuemax[to] = q->count;
+  net->linkfree[to] = start + t;
+  net->busy[to] += t;
+  return start + t;
+}
+
+/* random delay of a packet on top of the propagation delay, u is uniform
+   in [0,1) */
+static double jitter(const struct net *net, double u)
+{
+  if (net->params.delaydist == DELAY_EXP)
+    return -net->params.jitter * log(1.0 - u);
+  return 2.0 * net->params.jitter * u;
+}
+
 /************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet)
+void tolayer3(struct sim *sim, int AorB, struct pkt packet)
 /* A or B is sending to network  */
 {
+  struct net *net = sim->net;
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
-  int i;
+  struct event *evptr;
+  float lastime;
+  double x[4];              /* loss, delay, corruption and corruption kind */
+  double sent = 0.0;        /* when the link has sent the packet */
+  int i, n, flags = 0;
+  int to = (AorB+1) % 2;    /* the entity the packet goes to */
+  /* whether loss and corruption apply in this direction */
+  int lossy = !(AorB == B && sim->params.corruptdirection == A) && !(AorB == A && sim->params.corruptdirection == B);
 
-  ntolayer3++;
+  if (packet.length < 0 || packet.length > sim->mtu) {
+    printf("tolayer3: packet length %d is outside 0..%d (the MTU)\n", packet.length, sim->mtu);
+    exit(EXIT_FAILURE);
+  }
+  sim->ntolayer3++;
+  if (AorB == B)
+    sim->ntolayer3B++;
+  jimsrand_batch(sim, x, 4);
+
+  /* the channel is shared by the packets of every flow.  With linkqueue
+     it holds that many in each direction and drops any more (drop-tail),
+     and with red it starts dropping some before it is full */
+  n = linkqueued(net, to);
+  if (sim->params.red > 0.0)
+    redaverage(net, to, n);
+  if ((sim->params.linkqueue > 0 && n >= sim->params.linkqueue)
+      || (sim->params.red > 0.0 && reddrop(sim, to))) {
+    if (n >= sim->params.linkqueue) {
+      net->redcount[to] = 0;   /* a drop all the same for RED's spacing */
+      sim->nlinkdrops++;
+      if (TRACING(sim, 1))
+        printf("          TOLAYER3: channel queue is full, packet dropped\n");
+    }
+    else {
+      sim->nreddrops++;
+      if (TRACING(sim, 1))
+        printf("          TOLAYER3: packet dropped early by RED\n");
+    }
+    if (net->bintrace != NULL)
+      bintrace_record(net->bintrace, net->time, TR_TOLAYER3, AorB, TRF_LOST,
+                      packet.seqnum, packet.acknum, packet.checksum);
+    return;
+  }
+
+  /* with a bandwidth the packet takes up the link even if it is lost */
+  if (sim->params.bandwidth > 0.0)
+    sent = transmit(net, to, PKTHEADER + packet.length);
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    nlost++;
-    if (TRACE>0)    
+  if (lossy && channellost(sim, to, x[0])) {
+    sim->nlost++;
+    if (TRACING(sim, 1))    
       printf("          TOLAYER3: packet being lost\n");
+    if (net->bintrace != NULL)
+      bintrace_record(net->bintrace, net->time, TR_TOLAYER3, AorB, TRF_LOST,
+                      packet.seqnum, packet.acknum, packet.checksum);
     return;
   }  
 
-  /* make a copy of the packet student just gave me since he/she may decide */
-  /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  mypktptr->seqnum = packet.seqnum;
-  mypktptr->acknum = packet.acknum;
-  mypktptr->checksum = packet.checksum;
-  for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
-  if (TRACE>2)  {
+  /* create future event for arrival of packet at the other side */
+  evptr = newevent(net);
+
+  /* make a copy of the packet header student just gave me since he/she may */
+  /* decide to do something with the packet after we return back to him/her. */
+  /* The payload is not copied: the event holds a reference to its buffer   */
+  mypktptr = &evptr->pkt;         /* the copy travels inside the event */
+  *mypktptr = packet;
+  mypktptr->flow = sim->flow;
+  pbuf_hold(mypktptr->pbuf);
+  if (TRACING(sim, 3))  {
     printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
            mypktptr->acknum,  mypktptr->checksum);
-    for (i=0; i<20; i++)
+    for (i=0; i<mypktptr->length; i++)
       printf("%c",mypktptr->payload[i]);
     printf("\n");
   }
 
-  /* create future event for arrival of packet at the other side */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+  evptr->eventity = to;           /* event occurs at other entity */
+  evptr->flow = sim->flow;
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
-     currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+     currently in the medium on their way to the destination.  Once every
+     packet on the channel has been delivered its tail lies in the past.
+     A link with a bandwidth delivers the packet the propagation delay and
+     its jitter after sending it, but never before the packets ahead */
+  if (sim->params.bandwidth > 0.0) {
+    evptr->evtime = sent + sim->params.propdelay + jitter(net, x[1]);
+    if (evptr->evtime < net->channeltail[to])
+      evptr->evtime = net->channeltail[to];
+  }
+  else {
+    lastime = net->channeltail[to];
+    if (lastime < net->time)
+      lastime = net->time;
+    evptr->evtime =  lastime + 1 + 9*x[1];
+  }
+  net->channeltail[to] = evptr->evtime;
+  if (++net->inflight[to] > net->queuemax[to] && sim->params.bandwidth <= 0.0)
+    net->queuemax[to] = net->inflight[to];
  
 
 
   /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-      mypktptr->payload[0]='Z';   /* corrupt payload */
-    else if (x < .875)
-      mypktptr->seqnum = 999999;
+  if ((x[2] < sim->params.corruptprob) && lossy) {
+    sim->ncorrupt++;
+    flags = TRF_CORRUPT;
+    if (sim->params.flipbits > 0)
+      flipbits(sim, mypktptr, sim->params.flipbits);
     else
-      mypktptr->acknum = 999999;
-    if (TRACE>0)    
+      corruptpacket(sim, mypktptr, x[3]);
+    if (TRACING(sim, 1))    
       printf("          TOLAYER3: packet being corrupted\n");
   }  
 
-  if (TRACE>2)  
+  if (TRACING(sim, 3))  
     printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  if (net->bintrace != NULL)
+    bintrace_record(net->bintrace, net->time, TR_TOLAYER3, AorB, flags,
+                    packet.seqnum, packet.acknum, packet.checksum);
+  insertevent(net, evptr);
 } 
 
-void tolayer5(int AorB, char datasent[20])
+void tolayer5(struct sim *sim, int AorB, const char *datasent, int length)
 {
   int i;  
-  if (TRACE>2) {
+  if (TRACING(sim, 3)) {
     printf("          TOLAYER5: data received by application at ");
     if (AorB == A) 
       printf("A: ");
     else
       printf("B: ");
-    for (i=0; i<20; i++)  
+    for (i=0; i<length; i++)  
       printf("%c",datasent[i]);
     printf("\n");
   }
-  messages_delivered++;
+  if (sim->net->bintrace != NULL)
+    bintrace_record(sim->net->bintrace, sim->net->time, TR_TOLAYER5, AorB, 0, 0, 0, 0);
+  sim->bytes_delivered += length;
+  if (poppending(sim, (AorB+1) % 2))
+    sim->messages_delivered++;
 }
 
-int main(void)
+/* run the simulation until no events are left */
+static void simulate(struct net *net)
 {
+  struct sim *sim;
   struct event *eventptr;
   struct msg  msg2give;
   struct pkt  pkt2give;
+  struct pbuf *msgbuf;
    
-  int i,j;
+  int i,j,off;
+  int full;                 /* window_full before a segment is handed over */
+  int nseg;                 /* number of segments of a message */
   
-  init();
-  A_init();
-  B_init();
+  init(net);
+  for (i = 0; i < net->nflows; i++) {
+    A_init(&net->flows[i]);
+    B_init(&net->flows[i]);
+  }
    
   while (1) {
-    eventptr = evlist;            /* get next event to simulate */
+    eventptr = popevent(net);        /* get next event to simulate */
     if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
+      break;
+    net->nevents++;
+    if (TRACING(net, 2)) {
       printf("\nEVENT time: %f,",eventptr->evtime);
       printf("  type: %d",eventptr->evtype);
       if (eventptr->evtype==0)
@@ -417,62 +1413,666 @@ int main(void)
         printf(", fromlayer5 ");
       else
         printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
+      printf(" entity: %d",eventptr->eventity);
+      if (net->nflows > 1)
+        printf(" flow: %d",eventptr->flow);
+      printf("\n");
+    }
+    net->time = eventptr->evtime;        /* update time to next event time */
+    /* packets are handed to their connection, timers and messages to
+       the flow they belong to */
+    if (eventptr->evtype == FROM_LAYER3)
+      sim = &net->flows[eventptr->pkt.flow];
+    else
+      sim = &net->flows[eventptr->flow];
+    if (net->bintrace != NULL) {  /* event types match the TR_ record types */
+      if (eventptr->evtype == FROM_LAYER3)
+        bintrace_record(net->bintrace, net->time, TR_FROMLAYER3, eventptr->eventity, 0,
+                        eventptr->pkt.seqnum, eventptr->pkt.acknum, eventptr->pkt.checksum);
+      else
+        bintrace_record(net->bintrace, net->time, eventptr->evtype, eventptr->eventity, 0, 0, 0, 0);
     }
-    time = eventptr->evtime;        /* update time to next event time */
     if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
+      if (sim->nsim < sim->params.nsimmax) {
+        generate_next_arrival(sim);   /* set up future arrival */
         /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
-        for (i=0; i<20; i++)  
-          msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
+        j = sim->nsim % 26; 
+        msgbuf = newpbuf(sim);
+        memset(msgbuf->data, 97 + j, sim->params.msgsize);
+        if (TRACING(sim, 3)) {
           printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
+          for (i=0; i<sim->params.msgsize; i++) 
+            printf("%c", msgbuf->data[i]);
           printf("\n");
         }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
+        sim->nsim++;
+        /* hand the message over in segments of at most mtu bytes.  A
+           segment turned away by a full window is never delivered, and
+           the rest of its message is dropped with it.  With a send queue,
+           a sender is only given a message if its queue has room for all
+           of its segments, so that none is cut short.  The queue only
+           fills once the window is full, and checkparams makes sure it can
+           hold a whole message */
+        nseg = (sim->params.msgsize + sim->mtu - 1) / sim->mtu;
+        if (sim->sendq[eventptr->eventity]->capacity > 0
+            && sim->sendq[eventptr->eventity]->capacity - sim->sendq[eventptr->eventity]->count < nseg) {
+          if (TRACING(sim, 1))
+            printf("          MAINLOOP: send queue is full, message dropped\n");
+          sim->window_full++;
+        }
         else
-          B_output(msg2give);  
+        for (off = 0; off < sim->params.msgsize; off += msg2give.length) {
+          msg2give.data = msgbuf->data + off;
+          msg2give.pbuf = msgbuf;
+          msg2give.length = sim->params.msgsize - off;
+          if (msg2give.length > sim->mtu)
+            msg2give.length = sim->mtu;
+          full = sim->window_full;
+          if (eventptr->eventity == A) 
+            A_output(sim, msg2give);  
+          else
+            B_output(sim, msg2give);  
+          if (sim->window_full != full)
+            break;
+          pushpending(sim, eventptr->eventity, net->time, off + msg2give.length == sim->params.msgsize);
+        }
+        pbuf_release(sim, msgbuf);  /* the sender holds its own references */
       }
-      else if (TRACE > 2)
+      else if (TRACING(sim, 3))
           printf("          FROM_LAYER5: no more messages to send: \n");
     }
     else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
+      if (--net->inflight[eventptr->eventity] == 0)
+        net->idlesince[eventptr->eventity] = net->time;
+      pkt2give = eventptr->pkt;  /* header only, the payload is shared */
 	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
+        A_input(sim, pkt2give);            /* appropriate entity */
       else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
+        B_input(sim, pkt2give);
+      pbuf_release(sim, eventptr->pkt.pbuf);
     }
     else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
+      sim->timers[eventptr->eventity] = NULL;  /* timer has gone off */
+      if (eventptr->eventity == A) {
+        sim->ntimeouts++;
+        A_timerinterrupt(sim);
+      }
       else
-        B_timerinterrupt();
+        B_timerinterrupt(sim);
     }
     else  {
       printf("INTERNAL PANIC: unknown event type \n");
     }
-    free(eventptr);
+    freeevent(net, eventptr);
+  }
+}
+
+/* messages delivered per time unit */
+static double goodput(const struct sim *sim)
+{
+  return sim->net->time > 0.0 ? sim->messages_delivered / sim->net->time : 0.0;
+}
+
+/* packets resent per message delivered */
+static double overhead(const struct sim *sim)
+{
+  return sim->messages_delivered > 0 ? (double)sim->packets_resent / sim->messages_delivered : 0.0;
+}
+
+/* time a link with a bandwidth takes to send a full data packet */
+static double datatxtime(const struct net *net)
+{
+  int length = net->params.msgsize < net->params.mtu ? net->params.msgsize : net->params.mtu;
+
+  return (PKTHEADER + length) / net->params.bandwidth;
+}
+
+/* round trip of a data packet and its ACK over idle links: both are sent
+   and take the propagation delay and the mean jitter.  A sender keeps the
+   link busy if its window covers this much sending time */
+static double baseroundtrip(const struct net *net)
+{
+  return datatxtime(net) + PKTHEADER / net->params.bandwidth + 2.0 * (net->params.propdelay + net->params.jitter);
+}
+
+/* fraction of the time the link towards entity to has been sending */
+static double utilisation(const struct net *net, int to)
+{
+  return net->params.bandwidth > 0.0 && net->time > 0.0 ? net->busy[to] / net->time : 0.0;
+}
+
+/* payload delivered per time unit, as a fraction of the bandwidth */
+static double efficiency(const struct sim *sim)
+{
+  const struct net *net = sim->net;
+
+  return net->params.bandwidth > 0.0 && net->time > 0.0
+    ? sim->bytes_delivered / (net->params.bandwidth * net->time) : 0.0;
+}
+
+/* Jain's fairness index of the goodput of the flows: 1 if they all get
+   the same, down to 1/flows if one of them gets everything */
+static double fairness(const struct net *net)
+{
+  double sum = 0.0, sumsq = 0.0, x;
+  int i;
+
+  for (i = 0; i < net->nflows; i++) {
+    x = goodput(&net->flows[i]);
+    sum += x;
+    sumsq += x * x;
+  }
+  return sumsq > 0.0 ? sum * sum / (net->nflows * sumsq) : 0.0;
+}
+
+/* the statistics of every flow added up in total, for the report and the
+   CSV line.  The send queues of total are allocated for it, with the
+   highest high-water mark of the flows and all of their waits, and must
+   be freed with msgq_free */
+static void sumflows(struct net *net, struct sim *total)
+{
+  struct sim *f;
+  int i, e;
+
+  memset(total, 0, sizeof(struct sim));
+  total->net = net;
+  total->duplex = net->params.duplex;
+  total->sendq[A] = msgq_alloc(net->params.sendqueue);
+  total->sendq[B] = msgq_alloc(net->params.sendqueue);
+  for (i = 0; i < net->nflows; i++) {
+    f = &net->flows[i];
+    total->nsim += f->nsim;
+    total->window_full += f->window_full;
+    total->total_ACKs_received += f->total_ACKs_received;
+    total->new_ACKs += f->new_ACKs;
+    total->packets_resent += f->packets_resent;
+    total->ntimeouts += f->ntimeouts;
+    total->fast_retransmits += f->fast_retransmits;
+    total->packets_received += f->packets_received;
+    total->messages_delivered += f->messages_delivered;
+    total->ntolayer3 += f->ntolayer3;
+    total->ntolayer3B += f->ntolayer3B;
+    total->nlost += f->nlost;
+    total->ncorrupt += f->ncorrupt;
+    total->nlinkdrops += f->nlinkdrops;
+    total->nreddrops += f->nreddrops;
+    total->nlossbursts += f->nlossbursts;
+    total->bytes_delivered += f->bytes_delivered;
+    for (e = A; e <= (f->duplex ? B : A); e++) {
+      if (f->sendq[e]->highwater > total->sendq[e]->highwater)
+        total->sendq[e]->highwater = f->sendq[e]->highwater;
+      hist_merge(&total->sendq[e]->delay, &f->sendq[e]->delay);
+    }
   }
+}
+
+static void report(struct net *net)
+{
+  struct sim total, *sim = &total, *f;
+  struct msgq *q;
+  int i;
 
- terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
-  printf("number of messages dropped due to full window:  %d \n", window_full);
-  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+  sumflows(net, sim);
+  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",net->time,sim->nsim);
+  printf("number of messages dropped due to full window:  %d \n", sim->window_full);
+  for (i = A; i <= (sim->duplex ? B : A); i++)
+    if (sim->sendq[i]->capacity > 0) {
+      q = sim->sendq[i];
+      printf("highest number of messages in the send queue%s:  %d of %d \n", i == A ? "" : " of B", q->highwater, q->capacity);
+      if (q->delay.count > 0)
+        printf("time messages waited in the send queue%s:  p50 %f  p99 %f  max %f \n", i == A ? "" : " of B",
+               hist_quantile(&q->delay, 0.5) / LATENCY_SCALE, hist_quantile(&q->delay, 0.99) / LATENCY_SCALE,
+               q->delay.max / LATENCY_SCALE);
+    }
+  if (sim->duplex)
+    printf("(note: both A and B send data.  The counters below add up both directions, but timeouts\n"
+           " are the interrupts of A's timer, which it shares with the ACKs it delays)\n");
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", sim->new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
-  printf("number of packet resends by A:  %d \n", packets_resent);
-  printf("number of correct packets received at B:  %d \n", packets_received);
-  printf("number of messages delivered to application:  %d \n", messages_delivered);
+  printf("number of packet resends by A:  %d \n", sim->packets_resent);
+  printf("number of timeouts at A:  %d \n", sim->ntimeouts);
+  printf("number of fast retransmits by A:  %d \n", sim->fast_retransmits);
+  printf("number of correct packets received at B:  %d \n", sim->packets_received);
+  printf("number of packets sent by B:  %d \n", sim->ntolayer3B);
+  printf("number of messages delivered to application:  %d \n", sim->messages_delivered);
+  if (net->latency.count > 0)
+    printf("end-to-end latency of delivered messages:  p50 %f  p99 %f  p99.9 %f  max %f \n",
+           hist_quantile(&net->latency, 0.5) / LATENCY_SCALE, hist_quantile(&net->latency, 0.99) / LATENCY_SCALE,
+           hist_quantile(&net->latency, 0.999) / LATENCY_SCALE, net->latency.max / LATENCY_SCALE);
+  if (net->params.linkqueue > 0)
+    printf("number of packets dropped by the full channel queue:  %d  (most queued A->B %d, B->A %d, of %d) \n",
+           sim->nlinkdrops, net->queuemax[B], net->queuemax[A], net->params.linkqueue);
+  if (net->params.red > 0.0)
+    printf("number of packets dropped early by RED:  %d \n", sim->nreddrops);
+  if (net->params.lossmodel != LOSS_BERNOULLI)
+    printf("number of packets lost in media:  %d  in %d bursts, %f per burst \n", sim->nlost, sim->nlossbursts,
+           sim->nlossbursts > 0 ? (double)sim->nlost / sim->nlossbursts : 0.0);
+  if (net->params.bandwidth > 0.0) {
+    printf("bandwidth-delay product:  %f bytes, a window of %f packets keeps the link busy \n",
+           net->params.bandwidth * baseroundtrip(net), baseroundtrip(net) / datatxtime(net));
+    printf("utilisation of the link:  A->B %f  B->A %f \n", utilisation(net, B), utilisation(net, A));
+    printf("payload delivered:  %f of the bandwidth \n", efficiency(sim));
+  }
+  printf("number of events simulated:  %ld \n", net->nevents);
+  printf("goodput:  %f messages (%f bytes) per time unit \n", goodput(sim),
+         net->time > 0.0 ? sim->bytes_delivered / net->time : 0.0);
+  printf("retransmission overhead:  %f resends per delivered message \n", overhead(sim));
+  if (net->nflows > 1) {
+    printf("fairness of the goodput of the %d flows (Jain's index):  %f \n", net->nflows, fairness(net));
+    printf("%6s %10s %10s %10s %10s %10s %12s\n", "flow", "sent", "delivered", "goodput", "resends",
+           "timeouts", "mean latency");
+    for (i = 0; i < net->nflows; i++) {
+      f = &net->flows[i];
+      printf("%6d %10d %10d %10f %10d %10d %12f\n", i, f->nsim, f->messages_delivered, goodput(f),
+             f->packets_resent, f->ntimeouts, f->nlatency > 0 ? f->latencysum / f->nlatency : 0.0);
+    }
+  }
+  msgq_free(sim->sendq[A]);
+  msgq_free(sim->sendq[B]);
+}
+
+/********************* PARAMETER SWEEPS **************/
+/*  Every point of a sweep is simulated in its own   */
+/*  sim by a pool of worker threads.  Each point     */
+/*  leaves one CSV line for the main thread.         */
+/*****************************************************/
+
+#define SWEEPLINE 1024            /* longest CSV line of a point */
+
+/* state shared by the sweep workers, protected by lock */
+struct sweepstate {
+  pthread_mutex_t lock;
+  pthread_cond_t finished;        /* signalled whenever a point is done */
+  int npoints;
+  int next;                       /* next point to hand to a worker */
+  char (*lines)[SWEEPLINE];       /* CSV line of every point */
+  char *done;                     /* whether each point has finished */
+};
+
+/* number of points in the sweep, 1 if no parameter is swept */
+static int sweeppoints(void)
+{
+  int i, n = 1;
+
+  for (i = 0; i < NOPTIONS; i++)
+    if (options[i].npoints > 1)
+      n *= options[i].npoints;
+  return n;
+}
+
+/* set every parameter in p to its value at the given sweep point */
+static void setsweeppoint(int point, struct simparams *p)
+{
+  int i;
+
+  *p = params;
+  for (i = 0; i < NOPTIONS; i++)
+    if (options[i].npoints > 1) {
+      setpoint(&options[i], point % options[i].npoints, p);
+      point /= options[i].npoints;
+    }
+}
+
+static void printcsvheader(FILE *out)
+{
+  int i;
+
+  for (i = 0; i < NOPTIONS; i++)
+    if (options[i].offset != PARAM(trace))
+      fprintf(out, "%s,", options[i].name);
+  fprintf(out, "sim_time,msgs_sent,window_full,total_ACKs_received,new_ACKs,packets_resent,"
+          "timeouts,fast_retransmits,packets_received,messages_delivered,ntolayer3,ntolayer3_B,nlost,ncorrupt,events,"
+          "queue_highwater,queue_wait_p50,queue_wait_p99,"
+          "latency_p50,latency_p99,latency_p999,goodput,resend_overhead,link_drops,fairness,red_drops,utilisation,efficiency,loss_bursts\n");
+}
+
+/* check the result of an snprintf into the CSV line of a point */
+static int sweepappend(int point, int len, int n)
+{
+  if (n < 0 || n >= SWEEPLINE - len) {
+    printf("the CSV line of sweep point %d is longer than %d characters\n", point, SWEEPLINE - 1);
+    exit(EXIT_FAILURE);
+  }
+  return len + n;
+}
+
+/* simulate one point and format its CSV line */
+static void runsweeppoint(int point, char *line)
+{
+  struct simparams p;
+  struct net *net;
+  struct sim total, *sim = &total;
+  void *value;
+  int i, len = 0;
+
+  setsweeppoint(point, &p);
+  p.trace = 0;
+  net = newnet(&p);
+  net->quiet = 1;
+  simulate(net);
+  sumflows(net, sim);
+
+  for (i = 0; i < NOPTIONS; i++) {
+    if (options[i].offset == PARAM(trace))
+      continue;
+    value = (char *)&p + options[i].offset;
+    if (options[i].type == OPT_INT)
+      len = sweepappend(point, len, snprintf(line+len, SWEEPLINE-len, "%d,", *(int *)value));
+    else if (options[i].type == OPT_UINT)
+      len = sweepappend(point, len, snprintf(line+len, SWEEPLINE-len, "%u,", *(unsigned int *)value));
+    else
+      len = sweepappend(point, len, snprintf(line+len, SWEEPLINE-len, "%g,", *(float *)value));
+  }
+  sweepappend(point, len, snprintf(line+len, SWEEPLINE-len, "%f,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%ld,%d,%f,%f,%f,%f,%f,%f,%f,%d,%f,%d,%f,%f,%d\n", net->time, sim->nsim,
+          sim->window_full, sim->total_ACKs_received, sim->new_ACKs, sim->packets_resent,
+          sim->ntimeouts, sim->fast_retransmits, sim->packets_received, sim->messages_delivered, sim->ntolayer3, sim->ntolayer3B,
+          sim->nlost, sim->ncorrupt, net->nevents, sim->sendq[A]->highwater,
+          hist_quantile(&sim->sendq[A]->delay, 0.5) / LATENCY_SCALE, hist_quantile(&sim->sendq[A]->delay, 0.99) / LATENCY_SCALE,
+          hist_quantile(&net->latency, 0.5) / LATENCY_SCALE, hist_quantile(&net->latency, 0.99) / LATENCY_SCALE,
+          hist_quantile(&net->latency, 0.999) / LATENCY_SCALE, goodput(sim), overhead(sim), sim->nlinkdrops, fairness(net),
+          sim->nreddrops, utilisation(net, B), efficiency(sim), sim->nlossbursts));
+  msgq_free(sim->sendq[A]);
+  msgq_free(sim->sendq[B]);
+  freenet(net);
+}
+
+/* worker thread: simulate points until none are left */
+static void *sweepworker(void *arg)
+{
+  struct sweepstate *st = arg;
+  int point;
+
+  for (;;) {
+    pthread_mutex_lock(&st->lock);
+    point = st->next++;
+    pthread_mutex_unlock(&st->lock);
+    if (point >= st->npoints)
+      return NULL;
+
+    runsweeppoint(point, st->lines[point]);
+
+    pthread_mutex_lock(&st->lock);
+    st->done[point] = 1;
+    pthread_cond_signal(&st->finished);
+    pthread_mutex_unlock(&st->lock);
+  }
+}
+
+static void sweep(void)
+{
+  struct simparams p;
+  struct sweepstate st;
+  pthread_t *workers;
+  FILE *out = stdout;
+  int printed, i;
+
+  /* check every point before starting any worker */
+  st.npoints = sweeppoints();
+  for (i = 0; i < st.npoints; i++) {
+    setsweeppoint(i, &p);
+    checkparams(&p);
+  }
+  if (jobs <= 0)
+    jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0)
+    jobs = 1;
+  if (jobs > st.npoints)
+    jobs = st.npoints;
+  if (csvfile != NULL && (out = fopen(csvfile, "w")) == NULL) {
+    printf("unable to open %s\n", csvfile);
+    exit(EXIT_FAILURE);
+  }
+  workers = calloc(jobs, sizeof(pthread_t));
+  st.lines = calloc(st.npoints, SWEEPLINE);
+  st.done = calloc(st.npoints, 1);
+  if (workers == NULL || st.lines == NULL || st.done == NULL) {
+    printf("memory allocation for sweep failed.");
+    exit(EXIT_FAILURE);
+  }
+  st.next = 0;
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.finished, NULL);
+  printcsvheader(out);
+  fflush(out);
+
+  for (i = 0; i < jobs; i++)
+    if (pthread_create(&workers[i], NULL, sweepworker, &st) != 0) {
+      printf("unable to start sweep worker\n");
+      exit(EXIT_FAILURE);
+    }
+
+  /* results are written in point order as soon as they are available */
+  for (printed = 0; printed < st.npoints; printed++) {
+    pthread_mutex_lock(&st.lock);
+    while (!st.done[printed])
+      pthread_cond_wait(&st.finished, &st.lock);
+    pthread_mutex_unlock(&st.lock);
+    fputs(st.lines[printed], out);
+    fflush(out);
+  }
+
+  for (i = 0; i < jobs; i++)
+    pthread_join(workers[i], NULL);
+  pthread_mutex_destroy(&st.lock);
+  pthread_cond_destroy(&st.finished);
+  if (out != stdout)
+    fclose(out);
+  free(workers);
+  free(st.lines);
+  free(st.done);
+}
+
+/************************** CHECKSUM BENCHMARK ***************/
+
+static const char *cksumnames[] = {"sum", "internet", "crc32c"};
+static const char *corruptnames[] = {
+  "medium", "1-bit flip", "2-bit flip", "byte swap", "word swap"
+};
+#define NCORRUPTMODES ((int)(sizeof(corruptnames) / sizeof(corruptnames[0])))
+#define BENCH_TRIALS  100000
+#define BENCH_BYTES   (64L << 20)  /* bytes checksummed per kind and size */
+
+/* corrupt q, whose payload is a private copy, in the given mode */
+static void corruptmode(struct sim *sim, struct pkt *q, int mode)
+{
+  int i, j, k, bits = q->length * 8;
+  char c;
+
+  switch (mode) {
+  case 0:
+    corruptpacket(sim, q, jimsrand(sim));
+    break;
+  case 1:
+  case 2:
+    i = (int)(jimsrand(sim) * bits);
+    q->payload[i / 8] ^= 1 << (i % 8);
+    if (mode == 2) {
+      j = (int)(jimsrand(sim) * bits);
+      q->payload[j / 8] ^= 1 << (j % 8);
+    }
+    break;
+  case 3:
+    if (q->length < 2)
+      break;
+    i = (int)(jimsrand(sim) * (q->length - 1));
+    c = q->payload[i];
+    q->payload[i] = q->payload[i+1];
+    q->payload[i+1] = c;
+    break;
+  default:
+    if (q->length < 4)
+      break;
+    i = 2 * (int)(jimsrand(sim) * (q->length / 2));
+    j = 2 * (int)(jimsrand(sim) * (q->length / 2));
+    for (k = 0; k < 2; k++) {
+      c = q->payload[i+k];
+      q->payload[i+k] = q->payload[j+k];
+      q->payload[j+k] = c;
+    }
+    break;
+  }
+}
+
+/* whether the medium or corruptmode changed anything the checksum covers */
+static int pktchanged(const struct pkt *p, const struct pkt *q)
+{
+  return p->seqnum != q->seqnum || p->acknum != q->acknum || p->sack != q->sack || p->checksum != q->checksum
+    || memcmp(p->payload, q->payload, p->length) != 0;
+}
+
+/* the share of corrupted packets each checksum detects, for the corruption
+   of the medium and for errors a plain sum is known to miss, then the speed
+   of each checksum */
+static void benchchecksum(void)
+{
+  static const int sizes[] = {20, 1500, MAXMTU};
+  struct net *net;
+  struct sim *sim;
+  struct pkt p, q;
+  struct pbuf *orig;
+  char *data;
+  volatile unsigned sink = 0;
+  clock_t start;
+  double secs;
+  long n, iters, changed, detected;
+  int kind, mode, s, i;
+  uint16_t sum, old, new;
+
+  net = newnet(&params);
+  sim = &net->flows[0];
+  rng_seed(&net->rng, params.rng, params.seed, params.stream);
+  orig = newpbuf(sim);
+  p.length = params.mtu;
+  p.payload = orig->data;
+  p.pbuf = orig;
+  p.sack = 0;
+
+  printf("detection rate over %d corrupted packets of %d bytes\n", BENCH_TRIALS, params.mtu);
+  printf("%-12s", "corruption");
+  for (kind = CKSUM_SUM; kind <= CKSUM_CRC32C; kind++)
+    printf(" %10s", cksumnames[kind]);
+  printf("\n");
+  for (mode = 0; mode < NCORRUPTMODES; mode++) {
+    printf("%-12s", corruptnames[mode]);
+    for (kind = CKSUM_SUM; kind <= CKSUM_CRC32C; kind++) {
+      changed = detected = 0;
+      for (n = 0; n < BENCH_TRIALS; n++) {
+        p.seqnum = (int)(jimsrand(sim) * 8);
+        p.acknum = (int)(jimsrand(sim) * 8);
+        for (i = 0; i < p.length; i++)
+          p.payload[i] = 'a' + (int)(jimsrand(sim) * 26);
+        p.checksum = checksum_packet(kind, p.seqnum, p.acknum, p.sack, p.length, p.payload);
+        q = p;
+        if (mode == 0)
+          pbuf_hold(q.pbuf);      /* corruptpacket copies the payload itself */
+        else {
+          q.pbuf = newpbuf(sim);
+          q.payload = q.pbuf->data;
+          memcpy(q.payload, p.payload, p.length);
+        }
+        corruptmode(sim, &q, mode);
+        if (pktchanged(&p, &q)) {
+          changed++;
+          if (q.checksum != checksum_packet(kind, q.seqnum, q.acknum, q.sack, q.length, q.payload))
+            detected++;
+        }
+        pbuf_release(sim, q.pbuf);
+      }
+      printf(" %9.4f%%", changed ? 100.0 * detected / changed : 0.0);
+    }
+    printf("\n");
+  }
+  pbuf_release(sim, orig);
+  freenet(net);
+
+  data = malloc(MAXMTU);
+  if (data == NULL) {
+    printf("memory allocation for benchmark failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAXMTU; i++)
+    data[i] = (char)(i * 31 + 7);
+  printf("\nthroughput in MB/s, crc32c uses %s\n", crc32c_impl());
+  printf("%-12s", "bytes");
+  for (kind = CKSUM_SUM; kind <= CKSUM_CRC32C; kind++)
+    printf(" %10s", cksumnames[kind]);
+  printf("\n");
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+    printf("%-12d", sizes[s]);
+    iters = BENCH_BYTES / sizes[s];
+    for (kind = CKSUM_SUM; kind <= CKSUM_CRC32C; kind++) {
+      start = clock();
+      for (n = 0; n < iters; n++)
+        sink += (unsigned)checksum_packet(kind, (int)n, 0, 0, sizes[s], data);
+      secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+      printf(" %10.0f", secs > 0 ? (double)iters * sizes[s] / secs / 1e6 : 0.0);
+    }
+    printf("\n");
+  }
+
+  /* RFC 1624 update of one word against checksumming the packet again */
+  n = 0;
+  for (i = 0; i < BENCH_TRIALS; i++) {
+    sum = cksum_inet_fold(cksum_inet_add(0, data, 1500));
+    s = 2 * (i % 750);
+    memcpy(&old, data + s, 2);
+    new = (uint16_t)(old * 40503u + i);
+    memcpy(data + s, &new, 2);
+    if (cksum_inet_update(sum, old, new) != cksum_inet_fold(cksum_inet_add(0, data, 1500)))
+      n++;
+  }
+  printf("\nincremental internet checksum update: %ld of %d updates differ from a full computation\n",
+         n, BENCH_TRIALS);
+  free(data);
+}
+
+int main(int argc, char **argv)
+{
+  struct net *net;
+
+  checksum_init();
+  if (argc > 1)
+    parseargs(argc, argv);
+  if (losstracefile != NULL)
+    readlosstrace(losstracefile);
+  if (bench != NULL) {
+    if (strcmp(bench, "checksum") != 0) {
+      printf("unknown benchmark: %s\n", bench);
+      exit(EXIT_FAILURE);
+    }
+    checkparams(&params);
+    benchchecksum();
+    return EXIT_SUCCESS;
+  }
+  if (sweeppoints() > 1) {
+    if (bintracefile != NULL) {
+      printf("--bintrace can not be used for a sweep\n");
+      exit(EXIT_FAILURE);
+    }
+    sweep();
+    return EXIT_SUCCESS;
+  }
+  printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
+  if (argc <= 1)
+    askparams();
+  checkparams(&params);
+  if (params.trace > TRACE_MAX)
+    printf("Note: this build only traces up to level %d\n", TRACE_MAX);
+  if (bintracefile != NULL && params.flows > 1) {
+    printf("--bintrace can only trace a single flow\n");
+    exit(EXIT_FAILURE);
+  }
+  net = newnet(&params);
+  if (bintracefile != NULL && (net->bintrace = bintrace_open(bintracefile)) == NULL) {
+    printf("unable to open %s\n", bintracefile);
+    exit(EXIT_FAILURE);
+  }
+  simulate(net);
+  if (net->bintrace != NULL && bintrace_close(net->bintrace) != 0) {
+    printf("writing %s failed\n", bintracefile);
+    exit(EXIT_FAILURE);
+  }
+  report(net);
+  freenet(net);
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,40 +1,199 @@
-extern int TRACE;
-
-/* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+#include "rng.h"
+#include "hist.h"
 
 #define   A    0
 #define   B    1
 
+#define   MAXMTU  65536   /* largest payload a packet can carry */
+#define   CORRUPTSEQ 999999 /* the medium corrupts a header by setting a field to */
+                          /* this, so sequence numbers must stay below it      */
+#define   LATENCY_SCALE 1000.0 /* latencies are recorded in 1/1000 time units */
+#define   PKTHEADER 20    /* bytes of header a packet sends over a link with a bandwidth */
+
+/* with the sack parameter set, an ACK carries the cumulative acknum, the */
+/* last packet received in order, and in bit i of sack whether packet    */
+/* acknum+2+i has been received out of order (acknum+1 is missing)       */
+#define   SACKBITS 32
+
+/* payloads live in reference-counted buffers owned by the emulator.  The */
+/* data of a message is written once, when layer 5 creates it, and every  */
+/* packet carrying it refers to the same buffer until it is delivered.    */
+/* A buffer is only valid during the call it is passed in; a protocol     */
+/* that keeps a packet (e.g. in its window) takes a reference with        */
+/* pbuf_hold() and drops it with pbuf_release() when the packet goes.     */
+/* Payloads must never be written to.                                     */
+struct pbuf;
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
+/* Messages larger than the MTU are handed over in segments of at most    */
+/* sim->mtu bytes, each a view into the buffer of the whole message.      */
 struct msg {
-  char data[20];
+  int length;             /* number of bytes in data */
+  char *data;
+  struct pbuf *pbuf;      /* buffer holding data */
 };
 
 /* a packet is the data unit passed from layer 4 (students code) to layer */
 /* 3 (teachers code).  Note the pre-defined packet structure, which all   */
-/* students must follow. */
+/* students must follow.  The payload is held by reference, see above.    */
 struct pkt {
   int seqnum;
   int acknum;
+  uint32_t sack;          /* selective ACK bitmap, see SACKBITS */
   int checksum;
-  char payload[20];
+  int length;             /* number of bytes in payload, at most sim->mtu */
+  char *payload;
+  struct pbuf *pbuf;      /* buffer holding payload, NULL if there is none */
+  int flow;               /* connection the packet belongs to, set by tolayer3 */
+};
+
+/* parameters of a simulation run */
+struct simparams {
+  int nsimmax;            /* number of msgs every flow generates, then stops */
+  float lossprob;         /* probability that a packet is dropped  */
+  float corruptprob;      /* probability that one bit is packet is flipped */
+  int corruptdirection;   /* A->B A<-B or bidirectional corruption/loss */
+  float lambda;           /* arrival rate of messages from layer 5 */
+  int trace;              /* initial TRACE level */
+  unsigned int seed;      /* seed for the random number generator */
+  unsigned int stream;    /* stream of the generator, for independent replications */
+  int rng;                /* generator: RNG_XOSHIRO or RNG_PCG */
+  int mtu;                /* largest payload of a packet, in bytes */
+  int msgsize;            /* size of the messages from layer 5, in bytes */
+  int checksum;           /* packet integrity function, CKSUM_SUM etc. in checksum.h */
+  int window;             /* send window of the protocol, in packets */
+  int seqspace;           /* number of sequence numbers, 0 = the protocol minimum */
+  float rtt;              /* retransmission timeout of the protocol */
+  int rto;                /* 1: adapt the timeout to the measured round trip times */
+  int dupacks;            /* duplicate ACKs that trigger a fast retransmit, 0 = never */
+  int sack;               /* 1: ACKs are cumulative with a selective ACK bitmap */
+  int ackevery;           /* B ACKs every ackevery-th packet received in order */
+  float ackdelay;         /* longest time B holds back an ACK */
+  int sendqueue;          /* messages A queues while its window is full, 0 = drop them */
+  int duplex;             /* 1: B sends data to A as well, see B_output */
+  int flows;              /* number of sender/receiver pairs sharing the channel */
+  int linkqueue;          /* packets the channel holds in each direction, 0 = no limit */
+  float bandwidth;        /* link rate in bytes per time unit, 0 = 1 to 10 time units per packet */
+  float propdelay;        /* propagation delay of the link, with a bandwidth */
+  float jitter;           /* mean delay added to propdelay */
+  int delaydist;          /* distribution of the jitter: DELAY_UNIFORM or DELAY_EXP */
+  float red;              /* RED drop probability at the upper threshold, 0 = drop-tail */
+  int lossmodel;          /* how packets are lost: LOSS_BERNOULLI etc. below */
+  float pbad;             /* Gilbert-Elliott: probability of going from the good to the bad state */
+  float pgood;            /* and back, per packet */
+  float badloss;          /* loss probability in the bad state, lossprob is the one in the good */
+  int flipbits;           /* bits a corruption flips at random, 0 = the classic corruption */
+};
+
+#define   DELAY_UNIFORM 0  /* uniform in [0, 2*jitter] */
+#define   DELAY_EXP     1  /* exponential */
+
+#define   LOSS_BERNOULLI 0 /* every packet is lost with probability lossprob */
+#define   LOSS_GILBERT   1 /* Gilbert-Elliott: bursts of loss in a bad state */
+#define   LOSS_TRACE     2 /* replay the losses of a recorded trace, see --losstrace */
+
+/* a segment accepted by a sender and not yet delivered */
+struct pendingseg {
+  float time;             /* generation time of its message */
+  int last;               /* whether it is the last segment of the message */
+};
+
+/* segments a sender has accepted and not yet delivered, oldest first,
+   kept in a growing ring */
+struct pendingsegs {
+  struct pendingseg *segs;
+  int head;               /* oldest segment */
+  int count;
+  int capacity;
 };
 
+struct net;
+struct proto;             /* protocol state of A and B, defined by the protocol */
+struct msgq;
+
+/* everything belonging to one flow, a pair of entities A and B with
+   protocol state of their own.  The flows of a simulation share its
+   network, i.e. the clock, event list and channel; each run has its own
+   network, so several simulations can run side by side in one process.
+   Every routine below is passed the flow it works on */
+struct sim {
+  int trace;              /* TRACE: how much detail to print */
+  int mtu;                /* largest payload of a packet, in bytes */
+  int checksum;           /* integrity function for ComputeChecksum, see checksum.h */
+  int windowsize;         /* the maximum number of buffered unacked packets */
+  int seqspace;           /* sequence numbers are 0..seqspace-1 */
+  float rtt;              /* round trip time, the timeout of the protocol timer */
+  int adaptiverto;        /* estimate the timeout from the round trip times, see rto.h */
+  int dupacks;            /* duplicate ACKs that trigger a fast retransmit, 0 = never */
+  int sack;               /* ACKs are cumulative with a selective ACK bitmap, see SACKBITS */
+  int ackevery;           /* B may ACK only every ackevery-th packet received in order */
+  float ackdelay;         /* but must not hold back an ACK for longer than this */
+  int duplex;             /* B sends data as well, and data packets carry ACKs */
+  struct msgq *sendq[2];  /* messages waiting for room in the window of A and B, see msgq.h */
+
+  /* statistics updated by GBN */
+  int total_ACKs_received;
+  int packets_resent;     /* count of the number of packets resent  */
+  int new_ACKs;           /* count of the number of acks correctly received */
+  int packets_received;   /* count of the packets received by receiver */
+  int window_full;        /* count of the number of messages dropped due to full window */
+  int fast_retransmits;   /* count of the resends triggered by duplicate ACKs */
+
+  struct proto *proto;    /* state of the protocol entities */
+
+  /* the rest is private to the emulator */
+  struct net *net;        /* the network the flow sends over */
+  int flow;               /* number of the flow in its network */
+  struct simparams params;
+  int nsim;               /* number of messages from 5 to 4 so far */
+  int messages_delivered;
+  int ntolayer3;          /* number sent into layer 3 */
+  int ntolayer3B;         /* number of those sent by B, on the reverse path */
+  int nlost;              /* number lost in media */
+  int ncorrupt;           /* number corrupted by media*/
+  int nlinkdrops;         /* number dropped by the full channel queue */
+  int nreddrops;          /* number dropped early by RED */
+  int nlossbursts;        /* number of runs of consecutive packets lost in media */
+  int ntimeouts;          /* number of timer interrupts at A */
+  struct event *timers[2]; /* pending timer event of A and B */
+  double bytes_delivered; /* payload bytes passed up to layer 5 */
+
+  /* end-to-end latency of every delivered message.  Deliveries at one
+     side are matched in order to the segments accepted by the other side;
+     a message is delivered with its last segment.  The distribution over
+     all flows is kept by the network */
+  struct pendingsegs pending[2]; /* segments accepted by A and by B */
+  double latencysum;      /* sum of the latencies of the flow */
+  int nlatency;           /* and their number */
+};
+
+/* highest trace level compiled in.  The default keeps every level for
+   debugging; a benchmark build with -DTRACE_MAX=0 compiles all tracing
+   away, so the hot paths carry no test on the run-time trace level */
+#ifndef TRACE_MAX
+#define TRACE_MAX 4
+#endif
+
+/* whether sim traces at level lvl, i.e. TRACE >= lvl */
+#define TRACING(sim, lvl) ((lvl) <= TRACE_MAX && (sim)->trace >= (lvl))
+
 /* send to A or B (int), packet to send */
-extern void tolayer3(int, struct pkt);  
+extern void tolayer3(struct sim *, int, struct pkt);
 
-/* deliver to A or B (int), data to deliver */
-extern void tolayer5(int, char[20]); 
+/* deliver to A or B (int), data to deliver and its length */
+extern void tolayer5(struct sim *, int, const char *, int);
 
 /* start timer at A or B (int), increment */
-extern void starttimer(int, double);       
+extern void starttimer(struct sim *, int, double);
 
 /* stop timer at A or B (int) */
-extern void stoptimer(int);               
+extern void stoptimer(struct sim *, int);
+
+/* current simulation time */
+extern float simtime(struct sim *);
+
+/* take and drop a reference to a payload buffer, NULL is ignored */
+extern void pbuf_hold(struct pbuf *);
+extern void pbuf_release(struct sim *, struct pbuf *);
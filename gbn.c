@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "emulator.h"
+#include "checksum.h"
+#include "rto.h"
+#include "msgq.h"
 #include "gbn.h"
 
 /* ******************************************************************
@@ -20,256 +23,678 @@
    - removed bidirectional GBN code and other code not used by prac. 
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - added bidirectional transfer again (the duplex parameter): both
+   entities send data, and every data packet carries the cumulative
+   ACK of its sender's receiver in acknum
 **********************************************************************/
 
-#define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
-#define WINDOWSIZE 6    /* the maximum number of buffered unacked packet */
-#define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
+/* the round trip time, window size and sequence space are the rtt, window
+   and seqspace parameters of the emulator.  RTT MUST BE SET TO 16.0 when
+   submitting assignment.  With rto 1 the timeout adapts, starting at RTT */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
+#define NAME(e) ((e) == A ? 'A' : 'B')
+
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver  
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your 
    original checksum.  This procedure must generate a different checksum to the original if
    the packet is corrupted.
 */
-int ComputeChecksum(struct pkt packet)
+int ComputeChecksum(struct sim *sim, const struct pkt *packet)
 {
-  int checksum = 0;
-  int i;
-
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ ) 
-    checksum += (int)(packet.payload[i]);
-
-  return checksum;
+  /* the integrity function is chosen with the checksum parameter */
+  return checksum_packet(sim->checksum, packet->seqnum, packet->acknum, packet->sack,
+                         packet->length, packet->payload);
 }
 
-bool IsCorrupted(struct pkt packet)
+bool IsCorrupted(struct sim *sim, const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  /* numbers outside the sequence space are corruption the checksum missed */
+  if (packet->seqnum < NOTINUSE || packet->seqnum >= sim->seqspace
+      || packet->acknum < NOTINUSE || packet->acknum >= sim->seqspace)
+    return (true);
+  if (packet->checksum == ComputeChecksum(sim, packet))
     return (false);
   else
     return (true);
 }
 
 
-/********* Sender (A) variables and functions ************/
+/* one direction of the transfer: the sender at one entity and the
+   receiver at the other.  Transfer e is sent by entity e, so A's sender
+   and B's receiver are transfer A */
+struct transfer {
+  /* sender */
+  struct pkt *buffer;             /* array for storing packets waiting for ACK */
+  float *senttime;                /* when each packet in buffer was first sent */
+  bool *resent;                   /* whether it has been resent since (Karn's rule) */
+  bool *sacked;                   /* whether the receiver has reported it received out of order */
+  struct rto rto;                 /* retransmission timeout */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  int lastack;                    /* the latest ACK received */
+  int dupcount;                   /* duplicates of lastack received since */
+  bool rtxtimer;                  /* whether the retransmission timer is set */
+  double rtxdeadline;             /* and when it expires */
+
+  /* receiver */
+  int expectedseqnum;             /* the sequence number expected next by the receiver */
+  int B_nextseqnum;               /* the sequence number for the next ACKs sent by the receiver */
+  struct pkt *rcvbuffer;          /* with SACK, packets received after a gap */
+  int rcvfirst;                   /* index in rcvbuffer of the packet expected next */
+  int unacked;                    /* packets received in order but not ACKed yet */
+  bool acktimer;                  /* whether the delayed ACK timer is set */
+  double ackdeadline;             /* and when it expires */
+};
+
+/* state of the protocol entities A and B, one for every simulation.
+   Every entity has one timer in the emulator, shared by the
+   retransmission timer of its sender and the delayed ACK timer of its
+   receiver.  It runs to the earlier of the two */
+struct proto {
+  struct transfer t[2];           /* from A to B, and from B to A with duplex */
+  bool timerrunning[2];           /* whether the emulator's timer of each entity is started */
+  double timerdeadline[2];        /* the deadline it was started for */
+};
+
+static void transfer_alloc(struct sim *sim, struct transfer *p)
+{
+  p->buffer = calloc(sim->windowsize, sizeof(struct pkt));
+  p->senttime = calloc(sim->windowsize, sizeof(float));
+  p->resent = calloc(sim->windowsize, sizeof(bool));
+  p->sacked = calloc(sim->windowsize, sizeof(bool));
+  p->rcvbuffer = calloc(sim->windowsize, sizeof(struct pkt));
+  if (p->buffer == NULL || p->senttime == NULL || p->resent == NULL || p->sacked == NULL
+      || p->rcvbuffer == NULL) {
+    printf("memory allocation for protocol state failed.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void transfer_free(struct transfer *p)
+{
+  free(p->buffer);
+  free(p->senttime);
+  free(p->resent);
+  free(p->sacked);
+  free(p->rcvbuffer);
+}
+
+struct proto *proto_alloc(struct sim *sim)
+{
+  struct proto *p;
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  p = calloc(1, sizeof(struct proto));
+  if (p == NULL) {
+    printf("memory allocation for protocol state failed.");
+    exit(EXIT_FAILURE);
+  }
+  transfer_alloc(sim, &p->t[A]);
+  if (sim->duplex)
+    transfer_alloc(sim, &p->t[B]);
+  return p;
+}
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+/* payload buffers still referenced are freed with the simulation */
+void proto_free(struct proto *p)
 {
-  struct pkt sendpkt;
+  transfer_free(&p->t[A]);
+  transfer_free(&p->t[B]);
+  free(p);
+}
+
+/* the min sequence space for GBN must be at least windowsize + 1.  With
+   SACK, B keeps packets from a window ahead of the one A may still resend,
+   so the two windows must not overlap */
+int proto_minseqspace(const struct simparams *params)
+{
+  if (params->sack)
+    return 2 * params->window;
+  return params->window + 1;
+}
+
+/* both entities run a sender and a receiver */
+int proto_duplex(void)
+{
+  return 1;
+}
+
+
+/********* Timers ************/
+
+/* run the emulator's timer of entity e to its earliest deadline, if any */
+static void synctimer(struct sim *sim, int e)
+{
+  struct proto *pr = sim->proto;
+  struct transfer *snd = &pr->t[e], *rcv = &pr->t[1-e];
+  double deadline = 0.0;
+  bool set = false;
+
+  if (snd->rtxtimer) {
+    deadline = snd->rtxdeadline;
+    set = true;
+  }
+  if (rcv->acktimer && (!set || rcv->ackdeadline < deadline)) {
+    deadline = rcv->ackdeadline;
+    set = true;
+  }
+  if (pr->timerrunning[e] && (!set || deadline != pr->timerdeadline[e])) {
+    stoptimer(sim, e);
+    pr->timerrunning[e] = false;
+  }
+  if (!pr->timerrunning[e] && set) {
+    starttimer(sim, e, deadline - simtime(sim));
+    pr->timerrunning[e] = true;
+    pr->timerdeadline[e] = deadline;
+  }
+}
+
+/* (re)start the retransmission timer of the sender at e */
+static void startrtxtimer(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[e];
+
+  p->rtxtimer = true;
+  p->rtxdeadline = simtime(sim) + p->rto.timeout;
+  synctimer(sim, e);
+}
+
+static void stoprtxtimer(struct sim *sim, int e)
+{
+  sim->proto->t[e].rtxtimer = false;
+  synctimer(sim, e);
+}
+
+
+/********* Sender variables and functions ************/
+
+static void stopacktimer(struct sim *sim, int e);
+
+/* ACK the last packet received in order by the receiver at e in packet,
+   and with SACK report the packets kept after it.  This ACKs any delayed
+   packets as well */
+static void setack(struct sim *sim, int e, struct pkt *packet)
+{
+  struct transfer *p = &sim->proto->t[1-e];
   int i;
 
-  /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
-
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ ) 
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt); 
-
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE; 
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
-
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
-
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;  
+  p->unacked = 0;
+  if (p->acktimer)
+    stopacktimer(sim, e);
+
+  packet->acknum = (p->expectedseqnum + sim->seqspace - 1) % sim->seqspace;
+  packet->sack = 0;
+  for (i = 0; i < SACKBITS && i+1 < sim->windowsize; i++)
+    if (p->rcvbuffer[(p->rcvfirst + 1 + i) % sim->windowsize].seqnum != NOTINUSE)
+      packet->sack |= (uint32_t)1 << i;
+}
+
+/* put a message in the window of the sender at e, which must have room,
+   and send it */
+static void sendmessage(struct sim *sim, int e, struct msg message)
+{
+  struct transfer *p = &sim->proto->t[e];
+  struct pkt sendpkt;
+
+  /* windowlast will always be 0 for alternating bit; but not for GoBackN */
+  p->windowlast = (p->windowlast + 1) % sim->windowsize; 
+
+  /* create packet, its payload refers to the message.  With duplex it
+     carries the ACK of the receiver at e as well */
+  sendpkt.seqnum = p->A_nextseqnum;
+  sendpkt.acknum = NOTINUSE;
+  sendpkt.sack = 0;
+  if (sim->duplex)
+    setack(sim, e, &sendpkt);
+  sendpkt.length = message.length;
+  sendpkt.payload = message.data;
+  sendpkt.pbuf = message.pbuf;
+  sendpkt.checksum = ComputeChecksum(sim, &sendpkt); 
+
+  /* put packet in window buffer, keeping its payload until the slot is
+     reused by a later packet */
+  pbuf_release(sim, p->buffer[p->windowlast].pbuf);
+  pbuf_hold(sendpkt.pbuf);
+  p->buffer[p->windowlast] = sendpkt;
+  p->senttime[p->windowlast] = simtime(sim);
+  p->resent[p->windowlast] = false;
+  p->sacked[p->windowlast] = false;
+  p->windowcount++;
+
+  /* send out packet */
+  if (TRACING(sim, 1))
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3 (sim, e, sendpkt);
+
+  /* start timer if first packet in window */
+  if (p->windowcount == 1)
+    startrtxtimer(sim, e);
+
+  /* get next sequence number, wrap back to 0 */
+  p->A_nextseqnum = (p->A_nextseqnum + 1) % sim->seqspace;  
+}
+
+/* called from layer 5 (application layer) at e, passed the message to be
+   sent to other side */
+static void output(struct sim *sim, int e, struct msg message)
+{
+  struct transfer *p = &sim->proto->t[e];
+
+  /* if not blocked waiting on ACK, and no earlier message waits */
+  if ( p->windowcount < sim->windowsize && sim->sendq[e]->count == 0) {
+    if (TRACING(sim, 2))
+      printf("----%c: New message arrives, send window is not full, send new messge to layer3!\n", NAME(e));
+    sendmessage(sim, e, message);
+  }
+  /* if blocked, queue the message, keeping its payload until it is sent */
+  else if (msgq_push(sim->sendq[e], message, simtime(sim))) {
+    if (TRACING(sim, 1))
+      printf("----%c: New message arrives, send window is full, queue it\n", NAME(e));
+    pbuf_hold(message.pbuf);
   }
-  /* if blocked,  window is full */
+  /* window and send queue are full */
   else {
-    if (TRACE > 0)
-      printf("----A: New message arrives, send window is full\n");
-    window_full++;
+    if (TRACING(sim, 1))
+      printf("----%c: New message arrives, send window is full\n", NAME(e));
+    sim->window_full++;
   }
 }
 
+void A_output(struct sim *sim, struct msg message)
+{
+  output(sim, A, message);
+}
 
-/* called from layer 3, when a packet arrives for layer 4 
-   In this practical this will always be an ACK as B never sends data.
-*/
-void A_input(struct pkt packet)
+/* send queued messages while the window has room */
+static void drainqueue(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[e];
+  struct msg message;
+
+  while (p->windowcount < sim->windowsize && msgq_pop(sim->sendq[e], &message, simtime(sim))) {
+    if (TRACING(sim, 2))
+      printf("----%c: send window has room, send queued message to layer3!\n", NAME(e));
+    sendmessage(sim, e, message);
+    pbuf_release(sim, message.pbuf);
+  }
+}
+
+
+/* resend every packet in the window that the receiver has not SACKed and
+   start the timer, which must not be running.  With duplex, the packets
+   carry the latest ACK of the receiver at e */
+static void resendwindow(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[e];
+  bool started = false;
+  int i, slot;
+
+  for(i=0; i<p->windowcount; i++) {
+    slot = (p->windowfirst+i) % sim->windowsize;
+    if (p->sacked[slot])
+      continue;
+
+    if (TRACING(sim, 1))
+      printf ("---%c: resending packet %d\n", NAME(e), (p->buffer[slot]).seqnum);
+
+    if (sim->duplex) {
+      setack(sim, e, &p->buffer[slot]);
+      p->buffer[slot].checksum = ComputeChecksum(sim, &p->buffer[slot]);
+    }
+    tolayer3(sim, e,p->buffer[slot]);
+    p->resent[slot] = true;
+    sim->packets_resent++;
+    if (!started) {
+      startrtxtimer(sim, e);
+      started = true;
+    }
+  }
+}
+
+/* mark the packets in the SACK bitmap of an ACK, so they are not resent */
+static void marksacked(struct sim *sim, int e, const struct pkt *packet)
 {
+  struct transfer *p = &sim->proto->t[e];
+  int seqfirst = p->buffer[p->windowfirst].seqnum;
+  int i, offset;
+
+  for (i = 0; i < SACKBITS; i++)
+    if (packet->sack & (uint32_t)1 << i) {
+      offset = (packet->acknum + 2 + i - seqfirst + sim->seqspace) % sim->seqspace;
+      if (offset < p->windowcount)
+        p->sacked[(p->windowfirst + offset) % sim->windowsize] = true;
+    }
+}
+
+/* called from layer 3 at e, when an ACK arrives for the sender there.
+   In simplex transfer this is every packet for A, as B never sends data.
+   An ACK piggybacked on data is not counted as a duplicate, since the
+   other side sends data whether or not packets are missing */
+static void ackinput(struct sim *sim, int e, struct pkt packet, bool piggybacked)
+{
+  struct transfer *p = &sim->proto->t[e];
   int ackcount = 0;
   int i;
 
   /* if received ACK is not corrupted */ 
-  if (!IsCorrupted(packet)) {
-    if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
-    total_ACKs_received++;
+  if (!IsCorrupted(sim, &packet)) {
+    if (TRACING(sim, 1))
+      printf("----%c: uncorrupted ACK %d is received\n", NAME(e), packet.acknum);
+    sim->total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (p->windowcount != 0) {
+          int seqfirst = p->buffer[p->windowfirst].seqnum;
+          int seqlast = p->buffer[p->windowlast].seqnum;
+
+          marksacked(sim, e, &packet);
           /* check case when seqnum has and hasn't wrapped */
           if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
               ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
 
             /* packet is a new ACK */
-            if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
-            new_ACKs++;
+            if (TRACING(sim, 1))
+              printf("----%c: ACK %d is not a duplicate\n", NAME(e), packet.acknum);
+            sim->new_ACKs++;
+            p->lastack = packet.acknum;
+            p->dupcount = 0;
 
             /* cumulative acknowledgement - determine how many packets are ACKed */
             if (packet.acknum >= seqfirst)
               ackcount = packet.acknum + 1 - seqfirst;
             else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
+              ackcount = sim->seqspace - seqfirst + packet.acknum;
+
+            /* time the round trip of the packet ACKed, unless it was resent */
+            i = (p->windowfirst + ackcount - 1) % sim->windowsize;
+            rto_newack(&p->rto);
+            if (!p->resent[i])
+              rto_sample(&p->rto, simtime(sim) - p->senttime[i]);
 
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            p->windowfirst = (p->windowfirst + ackcount) % sim->windowsize;
 
             /* delete the acked packets from window buffer */
             for (i=0; i<ackcount; i++)
-              windowcount--;
+              p->windowcount--;
 
 	    /* start timer again if there are still more unacked packets in window */
-            stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
+            stoprtxtimer(sim, e);
+            if (p->windowcount > 0)
+              startrtxtimer(sim, e);
 
+            /* fill the room freed in the window */
+            drainqueue(sim, e);
+
+          }
+          else if (!piggybacked && packet.acknum == p->lastack && ++p->dupcount == sim->dupacks
+                   && !p->resent[p->windowfirst]) {
+            /* the window base is probably lost, and B drops everything
+               after it: go back to it now rather than wait for the timeout.
+               Once the base has been resent, the duplicates are more likely
+               caused by the packets sent before it */
+            if (TRACING(sim, 1))
+              printf ("----%c: %d duplicate ACKs received, fast retransmit from packet %d!\n",
+                      NAME(e), p->dupcount, p->buffer[p->windowfirst].seqnum);
+            sim->fast_retransmits++;
+            stoprtxtimer(sim, e);
+            resendwindow(sim, e);
           }
+          else if (TRACING(sim, 1))
+            printf ("----%c: duplicate ACK received, do nothing!\n", NAME(e));
         }
         else
-          if (TRACE > 0)
-        printf ("----A: duplicate ACK received, do nothing!\n");
+          if (TRACING(sim, 1))
+        printf ("----%c: duplicate ACK received, do nothing!\n", NAME(e));
   }
   else 
-    if (TRACE > 0)
-      printf ("----A: corrupted ACK is received, do nothing!\n");
+    if (TRACING(sim, 1))
+      printf ("----%c: corrupted ACK is received, do nothing!\n", NAME(e));
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt(void)
+/* the retransmission timer of the sender at e went off */
+static void rtxtimeout(struct sim *sim, int e)
 {
-  int i;
-
-  if (TRACE > 0)
-    printf("----A: time out,resend oldest packet!\n");
+  struct transfer *p = &sim->proto->t[e];
 
-  for(i=0; i<windowcount; i++) {
+  if (TRACING(sim, 1))
+    printf("----%c: time out,resend oldest packet!\n", NAME(e));
 
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
-
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
-    if (i==0) starttimer(A,RTT);
-  }
+  rto_backoff(&p->rto);
+  resendwindow(sim, e);
 }       
 
 
-
-/* the following routine will be called once (only) before any other */
-/* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+/* initialise the window, buffer and sequence number of the sender at e */
+static void senderinit(struct sim *sim, int e)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.  
+  struct transfer *p = &sim->proto->t[e];
+
+  p->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  p->windowfirst = 0;
+  p->windowlast = -1;   /* windowlast is where the last packet sent is stored.  
 		     new packets are placed in winlast + 1 
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+  p->windowcount = 0;
+  p->lastack = sim->seqspace - 1;  /* what B ACKs before anything arrives */
+  p->dupcount = 0;
+  p->rtxtimer = false;
+  rto_init(&p->rto, sim->adaptiverto, sim->rtt);
 }
 
 
 
-/********* Receiver (B)  variables and procedures ************/
+/********* Receiver variables and procedures ************/
+
+
+/* start the delayed ACK timer of the receiver at e */
+static void startacktimer(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[1-e];
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+  p->acktimer = true;
+  p->ackdeadline = simtime(sim) + sim->ackdelay;
+  synctimer(sim, e);
+}
 
+static void stopacktimer(struct sim *sim, int e)
+{
+  sim->proto->t[1-e].acktimer = false;
+  synctimer(sim, e);
+}
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+/* send an ACK on its own from the receiver at e */
+static void sendack(struct sim *sim, int e)
 {
+  struct transfer *p = &sim->proto->t[1-e];
   struct pkt sendpkt;
-  int i;
+
+  setack(sim, e, &sendpkt);
+
+  /* create packet */
+  sendpkt.seqnum = p->B_nextseqnum;
+  p->B_nextseqnum = (p->B_nextseqnum + 1) % 2;
+    
+  /* we don't have any data to send */
+  sendpkt.length = 0;
+  sendpkt.payload = NULL;
+  sendpkt.pbuf = NULL;
+
+  /* computer checksum */
+  sendpkt.checksum = ComputeChecksum(sim, &sendpkt); 
+
+  /* send out packet */
+  tolayer3 (sim, e, sendpkt);
+}
+
+/* called from layer 3 at e, when a data packet arrives for the receiver
+   there */
+static void datainput(struct sim *sim, int e, struct pkt packet)
+{
+  struct transfer *p = &sim->proto->t[1-e];
+  bool corrupted = IsCorrupted(sim, &packet);
+  bool filled = false;
+  int offset = 0, slot;
+
+  if (!corrupted)
+    offset = (packet.seqnum - p->expectedseqnum + sim->seqspace) % sim->seqspace;
 
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
-    if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
-    packets_received++;
+  if  ( (!corrupted)  && (packet.seqnum == p->expectedseqnum) ) {
+    if (TRACING(sim, 1))
+      printf("----%c: packet %d is correctly received, send ACK!\n", NAME(e), packet.seqnum);
+    sim->packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
-
-    /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    tolayer5(sim, e, packet.payload, packet.length);
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;        
+    p->expectedseqnum = (p->expectedseqnum + 1) % sim->seqspace;        
+    p->rcvfirst = (p->rcvfirst + 1) % sim->windowsize;
+
+    /* with SACK, packets received earlier may now be in order too */
+    while (p->rcvbuffer[p->rcvfirst].seqnum == p->expectedseqnum) {
+      if (TRACING(sim, 1))
+        printf("----%c: buffered packet %d is now in order!\n", NAME(e), p->expectedseqnum);
+      sim->packets_received++;
+      tolayer5(sim, e, p->rcvbuffer[p->rcvfirst].payload, p->rcvbuffer[p->rcvfirst].length);
+      p->rcvbuffer[p->rcvfirst].seqnum = NOTINUSE;
+      p->expectedseqnum = (p->expectedseqnum + 1) % sim->seqspace;
+      p->rcvfirst = (p->rcvfirst + 1) % sim->windowsize;
+      filled = true;
+    }
+
+    /* ACK at once when a gap has been filled, otherwise only every
+       ackevery-th packet, and at the latest ackdelay after the first
+       packet not ACKed.  With duplex, data sent meanwhile carries the ACK */
+    if (filled || ++p->unacked >= sim->ackevery)
+      sendack(sim, e);
+    else if (!p->acktimer)
+      startacktimer(sim, e);
+  }
+  else if (!corrupted && sim->sack && offset < sim->windowsize) {
+    /* with SACK, a packet after a gap is kept until the gap is filled,
+       holding a reference to its payload */
+    if (TRACING(sim, 1))
+      printf("----%c: packet %d is received out of order, keep it and send SACK!\n", NAME(e), packet.seqnum);
+    slot = (p->rcvfirst + offset) % sim->windowsize;
+    pbuf_release(sim, p->rcvbuffer[slot].pbuf);
+    pbuf_hold(packet.pbuf);
+    p->rcvbuffer[slot] = packet;
+    sendack(sim, e);
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
-    if (TRACE > 0) 
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+    if (TRACING(sim, 1)) 
+      printf("----%c: packet corrupted or not expected sequence number, resend ACK!\n", NAME(e));
+    sendack(sim, e);
   }
+}
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-    
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ ) 
-    sendpkt.payload[i] = '0';  
+/* the delayed ACK timer of the receiver at e went off, ackdelay after a
+   packet that has not been ACKed */
+static void acktimeout(struct sim *sim, int e)
+{
+  if (TRACING(sim, 1))
+    printf("----%c: ACK delay is over, send ACK!\n", NAME(e));
+  sendack(sim, e);
+}
 
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt); 
+/* initialise the receiver at e */
+static void receiverinit(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[1-e];
+  int i;
 
-  /* send out packet */
-  tolayer3 (B, sendpkt);
+  p->expectedseqnum = 0;
+  p->B_nextseqnum = 1;
+  p->rcvfirst = 0;
+  p->unacked = 0;
+  p->acktimer = false;
+  for (i = 0; i < sim->windowsize; i++)
+    p->rcvbuffer[i].seqnum = NOTINUSE;
+}
+
+
+/********* Entities A and B ************/
+
+/* called from layer 3 at e.  A packet without data is an ACK, and with
+   duplex a data packet carries an ACK as well */
+static void input(struct sim *sim, int e, struct pkt packet)
+{
+  if (packet.length == 0)
+    ackinput(sim, e, packet, false);
+  else {
+    if (sim->duplex && !IsCorrupted(sim, &packet))
+      ackinput(sim, e, packet, true);
+    datainput(sim, e, packet);
+  }
+}
+
+/* called when the timer of e goes off, for the earliest of the
+   deadlines it was started for */
+static void timerinterrupt(struct sim *sim, int e)
+{
+  struct proto *pr = sim->proto;
+  struct transfer *snd = &pr->t[e], *rcv = &pr->t[1-e];
+  double now = pr->timerdeadline[e];
+
+  pr->timerrunning[e] = false;
+  if (rcv->acktimer && rcv->ackdeadline <= now) {
+    rcv->acktimer = false;
+    acktimeout(sim, e);
+  }
+  if (snd->rtxtimer && snd->rtxdeadline <= now) {
+    snd->rtxtimer = false;
+    rtxtimeout(sim, e);
+  }
+  synctimer(sim, e);
+}
+
+void A_input(struct sim *sim, struct pkt packet)
+{
+  input(sim, A, packet);
+}
+
+void A_timerinterrupt(struct sim *sim)
+{
+  timerinterrupt(sim, A);
 }
 
 /* the following routine will be called once (only) before any other */
-/* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+/* entity A routines are called. You can use it to do any initialization */
+void A_init(struct sim *sim)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  sim->proto->timerrunning[A] = false;
+  senderinit(sim, A);
+  if (sim->duplex)
+    receiverinit(sim, A);
 }
 
-/******************************************************************************
- * The following functions need be completed only for bi-directional messages *
- *****************************************************************************/
+void B_input(struct sim *sim, struct pkt packet)
+{
+  input(sim, B, packet);
+}
 
-/* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)  
+void B_timerinterrupt(struct sim *sim)
 {
+  timerinterrupt(sim, B);
 }
 
-/* called when B's timer goes off */
-void B_timerinterrupt(void)
+/* the following routine will be called once (only) before any other */
+/* entity B routines are called. You can use it to do any initialization */
+void B_init(struct sim *sim)
 {
+  sim->proto->timerrunning[B] = false;
+  receiverinit(sim, B);
+  if (sim->duplex)
+    senderinit(sim, B);
 }
 
+/* with duplex, B sends data to A as well */
+void B_output(struct sim *sim, struct msg message)  
+{
+  output(sim, B, message);
+}
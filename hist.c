@@ -0,0 +1,91 @@
+/* ******************************************************************
+   Log-linear histogram, see hist.h.  Recording a value costs a few
+   shifts and no allocation, so it can be done for every message.
+**********************************************************************/
+#include <string.h>
+#include "hist.h"
+
+static int bucketof(uint64_t v)
+{
+  int shift = 0;
+
+  if (v < HIST_SUBCOUNT)
+    return (int)v;
+  while ((v >> shift) >= HIST_SUBCOUNT)
+    shift++;
+  /* v >> shift is now in [HIST_HALF, HIST_SUBCOUNT) */
+  return HIST_SUBCOUNT + (shift-1) * HIST_HALF + (int)(v >> shift) - HIST_HALF;
+}
+
+/* smallest value that falls in bucket b */
+static uint64_t lowestof(int b)
+{
+  int shift;
+
+  if (b < HIST_SUBCOUNT)
+    return (uint64_t)b;
+  shift = (b - HIST_SUBCOUNT) / HIST_HALF + 1;
+  return (uint64_t)((b - HIST_SUBCOUNT) % HIST_HALF + HIST_HALF) << shift;
+}
+
+void hist_init(struct hist *h)
+{
+  memset(h, 0, sizeof(struct hist));
+}
+
+void hist_add(struct hist *h, uint64_t value)
+{
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (h->count == 0 || value > h->max)
+    h->max = value;
+  h->count++;
+  h->sum += (double)value;
+  h->buckets[bucketof(value)]++;
+}
+
+void hist_merge(struct hist *h, const struct hist *from)
+{
+  int b;
+
+  if (from->count == 0)
+    return;
+  if (h->count == 0 || from->min < h->min)
+    h->min = from->min;
+  if (h->count == 0 || from->max > h->max)
+    h->max = from->max;
+  h->count += from->count;
+  h->sum += from->sum;
+  for (b = 0; b < HIST_BUCKETS; b++)
+    h->buckets[b] += from->buckets[b];
+}
+
+/* the middle of the bucket holding the value of rank q*count, kept
+   within the recorded minimum and maximum */
+uint64_t hist_quantile(const struct hist *h, double q)
+{
+  long rank, seen = 0;
+  uint64_t lo, hi, v;
+  int b;
+
+  if (h->count == 0)
+    return 0;
+  rank = (long)(q * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+  for (b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      break;
+  }
+  lo = lowestof(b);
+  hi = b+1 < HIST_BUCKETS ? lowestof(b+1) - 1 : lo;
+  v = lo + (hi - lo) / 2;
+  if (v < h->min)
+    v = h->min;
+  if (v > h->max)
+    v = h->max;
+  return v;
+}
@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+/* log-linear histogram in the style of HdrHistogram.  Values below
+   2^HIST_SUBBITS have a bucket of their own; above that every power of
+   two is split into 2^(HIST_SUBBITS-1) buckets, so a bucket is never
+   wider than 1/128 of the values it holds */
+#define HIST_SUBBITS  8
+#define HIST_SUBCOUNT (1 << HIST_SUBBITS)
+#define HIST_HALF     (HIST_SUBCOUNT / 2)
+#define HIST_BUCKETS  (HIST_SUBCOUNT + (64 - HIST_SUBBITS) * HIST_HALF)
+
+struct hist {
+  long count;             /* number of values recorded */
+  uint64_t min, max;
+  double sum;
+  long buckets[HIST_BUCKETS];
+};
+
+extern void hist_init(struct hist *);
+extern void hist_add(struct hist *, uint64_t value);
+
+/* add every value recorded in from to h */
+extern void hist_merge(struct hist *h, const struct hist *from);
+
+/* value below which a fraction q of the recorded values lie, 0 if empty */
+extern uint64_t hist_quantile(const struct hist *, double q);
@@ -0,0 +1,69 @@
+/* ******************************************************************
+   Send queue of a sender, see msgq.h.  A sim runs on one thread, so the
+   ring needs no locking: the emulator pushes from layer 5 and the
+   protocol pops from the same thread.  It is allocated at its full
+   size up front and never grows.
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include "emulator.h"
+#include "msgq.h"
+
+struct msgq *msgq_alloc(int capacity)
+{
+  struct msgq *q;
+
+  q = malloc(sizeof(struct msgq));
+  if (q == NULL) {
+    printf("memory allocation for send queue failed.");
+    exit(EXIT_FAILURE);
+  }
+  q->msgs = NULL;
+  if (capacity > 0) {
+    q->msgs = malloc(capacity * sizeof(struct queuedmsg));
+    if (q->msgs == NULL) {
+      printf("memory allocation for send queue failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  q->head = 0;
+  q->count = 0;
+  q->capacity = capacity;
+  q->highwater = 0;
+  hist_init(&q->delay);
+  return q;
+}
+
+void msgq_free(struct msgq *q)
+{
+  free(q->msgs);
+  free(q);
+}
+
+int msgq_push(struct msgq *q, struct msg m, float now)
+{
+  struct queuedmsg *e;
+
+  if (q->count == q->capacity)
+    return 0;
+  e = &q->msgs[(q->head + q->count) % q->capacity];
+  e->msg = m;
+  e->time = now;
+  if (++q->count > q->highwater)
+    q->highwater = q->count;
+  return 1;
+}
+
+int msgq_pop(struct msgq *q, struct msg *m, float now)
+{
+  struct queuedmsg *e;
+
+  if (q->count == 0)
+    return 0;
+  e = &q->msgs[q->head];
+  *m = e->msg;
+  hist_add(&q->delay, (uint64_t)((now - e->time) * LATENCY_SCALE + 0.5));
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  return 1;
+}
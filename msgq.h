@@ -0,0 +1,27 @@
+/* bounded FIFO of the messages a sender has accepted from layer 5 while
+   its window is full.  They move into the window, oldest first, as ACKs
+   free it.  The queue records how long messages wait in it and how long
+   it grows.  Include after emulator.h */
+struct queuedmsg {
+  struct msg msg;
+  float time;             /* when it was queued */
+};
+
+struct msgq {
+  struct queuedmsg *msgs; /* ring of capacity messages */
+  int head;               /* oldest message */
+  int count;
+  int capacity;           /* 0: messages are never queued */
+  int highwater;          /* most messages queued at once */
+  struct hist delay;      /* waits of the messages taken out, in 1/LATENCY_SCALE time units */
+};
+
+extern struct msgq *msgq_alloc(int capacity);
+extern void msgq_free(struct msgq *);
+
+/* append a message at time now.  Returns 0 if the queue is full */
+extern int msgq_push(struct msgq *, struct msg, float now);
+
+/* take the oldest message out at time now.  Returns 0 if the queue is
+   empty */
+extern int msgq_pop(struct msgq *, struct msg *, float now);
@@ -0,0 +1,139 @@
+/* ******************************************************************
+   Random number generators for the emulator.
+
+   - xoshiro256** is the default.  Streams are 2^128 draws apart, using
+   the jump function published with the generator.
+   - PCG-XSH-RR 64/32 selects its stream through the increment of the
+   underlying LCG.  Two 32-bit outputs make up each 64-bit draw.
+
+   Both are seeded through splitmix64, so any seed (including 0) gives a
+   well mixed initial state.
+**********************************************************************/
+#include "rng.h"
+
+#define PCG_MULT UINT64_C(6364136223846793005)
+
+static uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z;
+
+  z = (*x += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro_next(uint64_t *s)
+{
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+/* advance the generator by 2^128 draws */
+static void xoshiro_jump(uint64_t *s)
+{
+  static const uint64_t jump[4] = {
+    UINT64_C(0x180ec6d33cfd0aba), UINT64_C(0xd5a61266f0c9392c),
+    UINT64_C(0xa9582618e03fc9aa), UINT64_C(0x39abdc4529b1661c)
+  };
+  uint64_t t[4] = {0, 0, 0, 0};
+  int i, b;
+
+  for (i = 0; i < 4; i++)
+    for (b = 0; b < 64; b++) {
+      if (jump[i] & (UINT64_C(1) << b)) {
+        t[0] ^= s[0];
+        t[1] ^= s[1];
+        t[2] ^= s[2];
+        t[3] ^= s[3];
+      }
+      xoshiro_next(s);
+    }
+  for (i = 0; i < 4; i++)
+    s[i] = t[i];
+}
+
+static uint32_t pcg_next(uint64_t *s)
+{
+  uint64_t old = s[0];
+  uint32_t xorshifted, rot;
+
+  s[0] = old * PCG_MULT + s[1];
+  xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+  rot = (uint32_t)(old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+void rng_seed(struct rng *r, int kind, uint64_t seed, uint64_t stream)
+{
+  uint64_t i;
+
+  r->kind = kind;
+  if (kind == RNG_PCG) {
+    r->s[1] = (stream << 1) | 1;
+    r->s[0] = 0;
+    pcg_next(r->s);
+    r->s[0] += splitmix64(&seed);
+    pcg_next(r->s);
+  }
+  else {
+    for (i = 0; i < 4; i++)
+      r->s[i] = splitmix64(&seed);
+    for (i = 0; i < stream; i++)
+      xoshiro_jump(r->s);
+  }
+}
+
+uint64_t rng_next(struct rng *r)
+{
+  uint64_t hi;
+
+  if (r->kind == RNG_PCG) {
+    hi = pcg_next(r->s);
+    return (hi << 32) | pcg_next(r->s);
+  }
+  return xoshiro_next(r->s);
+}
+
+/* the top 53 bits give every double in [0,1) that is a multiple of 2^-53 */
+double rng_uniform(struct rng *r)
+{
+  return (double)(rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* the state is copied into locals so the compiler can keep it in
+   registers for the whole batch instead of reloading it every draw */
+void rng_uniforms(struct rng *r, double *u, int n)
+{
+  uint64_t s[4];
+  int i;
+
+  if (r->kind == RNG_PCG) {
+    for (i = 0; i < n; i++)
+      u[i] = rng_uniform(r);
+    return;
+  }
+  s[0] = r->s[0];
+  s[1] = r->s[1];
+  s[2] = r->s[2];
+  s[3] = r->s[3];
+  for (i = 0; i < n; i++)
+    u[i] = (double)(xoshiro_next(s) >> 11) * (1.0 / 9007199254740992.0);
+  r->s[0] = s[0];
+  r->s[1] = s[1];
+  r->s[2] = s[2];
+  r->s[3] = s[3];
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+/* random number generators available to a simulation */
+#define RNG_XOSHIRO 0     /* xoshiro256** (Blackman and Vigna) */
+#define RNG_PCG     1     /* PCG-XSH-RR 64/32 (O'Neill) */
+
+/* the state of one generator.  Every simulation owns its own, so runs on
+   different threads never share a generator */
+struct rng {
+  int kind;               /* RNG_XOSHIRO or RNG_PCG */
+  uint64_t s[4];          /* xoshiro: state, pcg: state and increment */
+};
+
+/* seed a generator.  Generators with the same seed but different streams
+   produce independent sequences, e.g. for the replications of a sweep */
+extern void rng_seed(struct rng *, int kind, uint64_t seed, uint64_t stream);
+
+/* next 64 random bits */
+extern uint64_t rng_next(struct rng *);
+
+/* uniform double in [0,1) */
+extern double rng_uniform(struct rng *);
+
+/* fill the array with n uniform doubles in [0,1) */
+extern void rng_uniforms(struct rng *, double *, int n);
@@ -0,0 +1,50 @@
+/* ******************************************************************
+   Retransmission timeout estimation, see rto.h.  The gains are those
+   of RFC 6298: alpha = 1/8, beta = 1/4 and K = 4.
+**********************************************************************/
+#include "rto.h"
+
+void rto_init(struct rto *r, int adaptive, double initial)
+{
+  r->adaptive = adaptive;
+  r->nsamples = 0;
+  r->srtt = 0.0;
+  r->rttvar = 0.0;
+  r->base = initial;
+  r->timeout = initial;
+}
+
+void rto_sample(struct rto *r, double rtt)
+{
+  double err;
+
+  if (!r->adaptive)
+    return;
+  if (r->nsamples++ == 0) {
+    r->srtt = rtt;
+    r->rttvar = rtt / 2;
+  }
+  else {
+    err = rtt - r->srtt;
+    r->rttvar += ((err < 0 ? -err : err) - r->rttvar) / 4;
+    r->srtt += err / 8;
+  }
+  r->base = r->srtt + 4 * r->rttvar;
+  if (r->base < RTO_MIN)
+    r->base = RTO_MIN;
+  r->timeout = r->base;
+}
+
+void rto_backoff(struct rto *r)
+{
+  if (!r->adaptive)
+    return;
+  r->timeout *= 2;
+  if (r->timeout > r->base * RTO_BACKOFF)
+    r->timeout = r->base * RTO_BACKOFF;
+}
+
+void rto_newack(struct rto *r)
+{
+  r->timeout = r->base;
+}
@@ -0,0 +1,29 @@
+/* retransmission timeout of a sender.  The adaptive timeout follows RFC
+   6298 (Jacobson/Karels): a smoothed round trip time and its mean
+   deviation are estimated from acknowledged packets, and the timeout is
+   doubled on every expiry.  Following Karn's rule the sender must only
+   pass samples of packets that were never retransmitted */
+#define RTO_MIN     2.0   /* the medium takes at least 1 time unit each way */
+#define RTO_BACKOFF 64.0  /* the timeout backs off to at most 64 times its estimate */
+
+struct rto {
+  int adaptive;           /* 0: the timeout stays at its initial value */
+  int nsamples;           /* number of round trip times measured */
+  double srtt;            /* smoothed round trip time */
+  double rttvar;          /* mean deviation of the round trip time */
+  double base;            /* the timeout before any backoff */
+  double timeout;         /* the timeout to start the timer with */
+};
+
+extern void rto_init(struct rto *, int adaptive, double initial);
+
+/* a round trip time measured on a packet that was sent only once */
+extern void rto_sample(struct rto *, double rtt);
+
+/* the timer expired, back off */
+extern void rto_backoff(struct rto *);
+
+/* a packet was newly acknowledged, so the path works again: return to
+   the estimated timeout, as Linux does, rather than keep the backoff
+   until the next sample */
+extern void rto_newack(struct rto *);
@@ -2,15 +2,18 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "emulator.h"
+#include "checksum.h"
+#include "rto.h"
+#include "msgq.h"
 #include "gbn.h"
 
 /* ******************************************************************
-   Go Back N protocol.  Adapted from J.F.Kurose
+   Selective Repeat protocol.  Adapted from J.F.Kurose
    ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.2  
 
    Network properties:
    - one way network delay averages five time units (longer if there
-   are other messages in the channel for GBN), but can be larger
+   are other messages in the channel), but can be larger
    - packets can be corrupted (either the header or the data portion)
    or lost, according to user-defined probabilities
    - packets will be delivered in the order in which they were sent
@@ -19,321 +22,751 @@
    Modifications: 
    - removed bidirectional GBN code and other code not used by prac. 
    - fixed C style to adhere to current programming style
-   - added GBN implementation
+   - added SR implementation: the receiver keeps the packets that
+   arrive out of order, and the sender resends every packet on its own.
+   Each unacked packet has a logical timer, a deadline in a min-heap,
+   and the single timer of the sender's entity in the emulator runs to
+   the earliest of them
+   - added bidirectional transfer again (the duplex parameter).  With
+   cumulative ACKs, every data packet carries the ACK of its sender's
+   receiver in acknum
 **********************************************************************/
 
-#define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
-#define WINDOWSIZE 6    /* the maximum number of buffered unacked packet */
-#define SEQSPACE 12      /* the min sequence space for GBN must be at least windowsize + 1 */
+/* the round trip time, window size and sequence space are the rtt, window
+   and seqspace parameters of the emulator.  RTT MUST BE SET TO 16.0 when
+   submitting assignment.  With rto 1 the timeout adapts, starting at RTT */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
+#define NAME(e) ((e) == A ? 'A' : 'B')
+
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver  
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your 
    original checksum.  This procedure must generate a different checksum to the original if
    the packet is corrupted.
 */
-int ComputeChecksum(struct pkt packet)
+int ComputeChecksum(struct sim *sim, const struct pkt *packet)
 {
-  int checksum = 0;
-  int i;
-
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ ) 
-    checksum += (int)(packet.payload[i]);
-
-  return checksum;
+  /* the integrity function is chosen with the checksum parameter */
+  return checksum_packet(sim->checksum, packet->seqnum, packet->acknum, packet->sack,
+                         packet->length, packet->payload);
 }
 
-bool IsCorrupted(struct pkt packet)
+bool IsCorrupted(struct sim *sim, const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  /* numbers outside the sequence space are corruption the checksum missed */
+  if (packet->seqnum < NOTINUSE || packet->seqnum >= sim->seqspace
+      || packet->acknum < NOTINUSE || packet->acknum >= sim->seqspace)
+    return (true);
+  if (packet->checksum == ComputeChecksum(sim, packet))
     return (false);
   else
     return (true);
 }
 
 
-/********* Sender (A) variables and functions ************/
+/* one direction of the transfer: the sender at one entity and the
+   receiver at the other.  Transfer e is sent by entity e, so A's sender
+   and B's receiver are transfer A */
+struct transfer {
+  /* sender */
+  struct pkt *buffer;             /* array for storing packets waiting for ACK */
+  float *senttime;                /* when each packet in buffer was first sent */
+  float *lastsent;                /* when it was last sent, first or resent */
+  int *resends;                   /* times it has been resent, not timed if any (Karn's rule) */
+  bool *acked;                    /* whether it has been ACKed */
+  struct rto rto;                 /* retransmission timeout */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  int ackcount;                   /* packets ACKed while an earlier packet is still unacked */
+
+  /* every unacked packet has a retransmission deadline of its own.  The
+     slots with a deadline form a min-heap, and the emulator's single
+     timer of the sender's entity runs to the earliest one */
+  float *deadline;                /* retransmission deadline of each slot */
+  int *timerheap;                 /* slots with a deadline, earliest first */
+  int *heappos;                   /* position of each slot in timerheap, -1 if none */
+  int ntimers;                    /* number of slots in timerheap */
+  float ackedsent;                /* latest first send of a packet ACKed */
+  float lastnewack;               /* when the last new ACK arrived */
+
+  /* receiver */
+  int expectedseqnum;             /* the sequence number expected next by the receiver */
+  int B_nextseqnum;               /* the sequence number for the next ACKs sent by the receiver */
+  struct pkt *rcvBuffer;          /* packets received out of order */
+  int bWindowStart;               /* index of the first packet in rcvBuffer */
+  int unacked;                    /* with SACK, packets delivered but not ACKed yet */
+  bool acktimer;                  /* whether the delayed ACK timer is set */
+  float ackdeadline;              /* and when it expires */
+};
+
+/* state of the protocol entities A and B, one for every simulation.
+   Every entity has one timer in the emulator, shared by the packets of
+   its sender and the delayed ACK timer of its receiver */
+struct proto {
+  struct transfer t[2];           /* from A to B, and from B to A with duplex */
+  bool timerrunning[2];           /* whether the emulator's timer of each entity is started */
+  float timerdeadline[2];         /* the deadline it was started for */
+};
+
+static void transfer_alloc(struct sim *sim, struct transfer *p)
+{
+  p->buffer = calloc(sim->windowsize, sizeof(struct pkt));
+  p->rcvBuffer = calloc(sim->windowsize, sizeof(struct pkt));
+  p->senttime = calloc(sim->windowsize, sizeof(float));
+  p->lastsent = calloc(sim->windowsize, sizeof(float));
+  p->resends = calloc(sim->windowsize, sizeof(int));
+  p->acked = calloc(sim->windowsize, sizeof(bool));
+  p->deadline = calloc(sim->windowsize, sizeof(float));
+  p->timerheap = calloc(sim->windowsize, sizeof(int));
+  p->heappos = calloc(sim->windowsize, sizeof(int));
+  if (p->buffer == NULL || p->rcvBuffer == NULL || p->senttime == NULL || p->lastsent == NULL || p->resends == NULL
+      || p->acked == NULL || p->deadline == NULL || p->timerheap == NULL || p->heappos == NULL) {
+    printf("memory allocation for protocol state failed.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void transfer_free(struct transfer *p)
+{
+  free(p->buffer);
+  free(p->rcvBuffer);
+  free(p->senttime);
+  free(p->lastsent);
+  free(p->resends);
+  free(p->acked);
+  free(p->deadline);
+  free(p->timerheap);
+  free(p->heappos);
+}
+
+struct proto *proto_alloc(struct sim *sim)
+{
+  struct proto *p;
+
+  p = calloc(1, sizeof(struct proto));
+  if (p == NULL) {
+    printf("memory allocation for protocol state failed.");
+    exit(EXIT_FAILURE);
+  }
+  transfer_alloc(sim, &p->t[A]);
+  if (sim->duplex)
+    transfer_alloc(sim, &p->t[B]);
+  return p;
+}
+
+/* payload buffers still referenced are freed with the simulation */
+void proto_free(struct proto *p)
+{
+  transfer_free(&p->t[A]);
+  transfer_free(&p->t[B]);
+  free(p);
+}
+
+/* the sender and receiver windows must not overlap in the sequence space,
+   so SR needs at least twice the window size */
+int proto_minseqspace(const struct simparams *params)
+{
+  return 2 * params->window;
+}
+
+/* both entities run a sender and a receiver */
+int proto_duplex(void)
+{
+  return 1;
+}
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
 
-/*need for sr implementation*/
-static int ackcount = 0;
+/********* Logical timers ************/
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+static void heapswap(struct transfer *p, int i, int j)
 {
+  int slot = p->timerheap[i];
+
+  p->timerheap[i] = p->timerheap[j];
+  p->timerheap[j] = slot;
+  p->heappos[p->timerheap[i]] = i;
+  p->heappos[p->timerheap[j]] = j;
+}
+
+static void heapup(struct transfer *p, int i)
+{
+  while (i > 0 && p->deadline[p->timerheap[i]] < p->deadline[p->timerheap[(i-1)/2]]) {
+    heapswap(p, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void heapdown(struct transfer *p, int i)
+{
+  int c;
+
+  while ((c = 2*i + 1) < p->ntimers) {
+    if (c+1 < p->ntimers && p->deadline[p->timerheap[c+1]] < p->deadline[p->timerheap[c]])
+      c++;
+    if (p->deadline[p->timerheap[i]] <= p->deadline[p->timerheap[c]])
+      break;
+    heapswap(p, i, c);
+    i = c;
+  }
+}
+
+/* (re)arm the timer of a window slot */
+static void armtimer(struct transfer *p, int slot, float deadline)
+{
+  p->deadline[slot] = deadline;
+  if (p->heappos[slot] < 0) {
+    p->heappos[slot] = p->ntimers;
+    p->timerheap[p->ntimers++] = slot;
+  }
+  heapup(p, p->heappos[slot]);
+  heapdown(p, p->heappos[slot]);
+}
+
+static void canceltimer(struct transfer *p, int slot)
+{
+  int i = p->heappos[slot];
+
+  if (i < 0)
+    return;
+  heapswap(p, i, --p->ntimers);
+  p->heappos[slot] = -1;
+  if (i < p->ntimers) {
+    heapup(p, i);
+    heapdown(p, i);
+  }
+}
+
+/* run the emulator's timer of entity e to its earliest deadline, if any:
+   that of the packets of its sender or the ACK delay of its receiver */
+static void synctimer(struct sim *sim, int e)
+{
+  struct proto *pr = sim->proto;
+  struct transfer *snd = &pr->t[e], *rcv = &pr->t[1-e];
+  float deadline = 0.0;
+  bool set = false;
+
+  if (snd->ntimers > 0) {
+    deadline = snd->deadline[snd->timerheap[0]];
+    set = true;
+  }
+  if (rcv->acktimer && (!set || rcv->ackdeadline < deadline)) {
+    deadline = rcv->ackdeadline;
+    set = true;
+  }
+  if (pr->timerrunning[e] && (!set || deadline != pr->timerdeadline[e])) {
+    stoptimer(sim, e);
+    pr->timerrunning[e] = false;
+  }
+  if (!pr->timerrunning[e] && set) {
+    pr->timerdeadline[e] = deadline;
+    starttimer(sim, e, pr->timerdeadline[e] - simtime(sim));
+    pr->timerrunning[e] = true;
+  }
+}
+
+
+/********* Sender variables and functions ************/
+
+static void stopacktimer(struct sim *sim, int e);
+
+/* ACK in packet the last packet received in order by the receiver at e,
+   with a bitmap of the packets kept after it.  This ACKs any delayed
+   packets as well */
+static void setack(struct sim *sim, int e, struct pkt *packet)
+{
+  struct transfer *p = &sim->proto->t[1-e];
+  int i;
+
+  p->unacked = 0;
+  if (p->acktimer)
+    stopacktimer(sim, e);
+
+  packet->acknum = (p->expectedseqnum + sim->seqspace - 1) % sim->seqspace;
+  packet->sack = 0;
+  for (i = 0; i < SACKBITS && i+1 < sim->windowsize; i++)
+    if (p->rcvBuffer[(p->bWindowStart + 1 + i) % sim->windowsize].seqnum != NOTINUSE)
+      packet->sack |= (uint32_t)1 << i;
+}
+
+/* put a message in the window of the sender at e, which must have room,
+   and send it */
+static void sendmessage(struct sim *sim, int e, struct msg message)
+{
+  struct transfer *p = &sim->proto->t[e];
   struct pkt sendpkt;
+
+  /* windowlast will always be 0 for alternating bit; but not for GoBackN */    
+  p->windowlast = (p->windowlast + 1) % sim->windowsize;
+
+  /* create packet, its payload refers to the message.  With duplex and
+     cumulative ACKs it carries the ACK of the receiver at e as well */
+  sendpkt.seqnum = p->A_nextseqnum;
+  sendpkt.acknum = NOTINUSE;
+  sendpkt.sack = 0;
+  if (sim->duplex && sim->sack)
+    setack(sim, e, &sendpkt);
+  sendpkt.length = message.length;
+  sendpkt.payload = message.data;
+  sendpkt.pbuf = message.pbuf;
+  sendpkt.checksum = ComputeChecksum(sim, &sendpkt); 
+
+  /* put packet in window buffer, keeping its payload until the slot is
+     reused by a later packet */
+  pbuf_release(sim, p->buffer[p->windowlast].pbuf);
+  pbuf_hold(sendpkt.pbuf);
+  p->buffer[p->windowlast] = sendpkt;
+  p->senttime[p->windowlast] = simtime(sim);
+  p->lastsent[p->windowlast] = simtime(sim);
+  p->resends[p->windowlast] = 0;
+  p->acked[p->windowlast] = false;
+  p->windowcount++;
   
-  int i;
+
+  /* send out packet */
+  if (TRACING(sim, 1))
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3 (sim, e, sendpkt);
+
+  /* the packet gets a timer of its own */
+  armtimer(p, p->windowlast, simtime(sim) + p->rto.timeout);
+  synctimer(sim, e);
+
+  /* get next sequence number, wrap back to 0 */
+  p->A_nextseqnum = (p->A_nextseqnum + 1) % sim->seqspace;
+}
+
+/* called from layer 5 (application layer) at e, passed the message to be
+   sent to other side */
+static void output(struct sim *sim, int e, struct msg message)
+{
+  struct transfer *p = &sim->proto->t[e];
 
 
-  /* if not blocked waiting on ACK */
-  if (windowcount + ackcount < WINDOWSIZE) 
+  /* if not blocked waiting on ACK, and no earlier message waits */
+  if (p->windowcount + p->ackcount < sim->windowsize && sim->sendq[e]->count == 0)
   {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
-
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++) 
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt); 
-
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */    
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-    
-
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
-
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
-
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;  
+    if (TRACING(sim, 2))
+      printf("----%c: New message arrives, send window is not full, send new messge to layer3!\n", NAME(e));
+    sendmessage(sim, e, message);
   }
-  /* if blocked,  window is full */
+  /* if blocked, queue the message, keeping its payload until it is sent */
+  else if (msgq_push(sim->sendq[e], message, simtime(sim))) {
+    if (TRACING(sim, 1))
+      printf("----%c: New message arrives, send window is full, queue it\n", NAME(e));
+    pbuf_hold(message.pbuf);
+  }
+  /* window and send queue are full */
   else {
-    if (TRACE > 0)
-      printf("----A: New message arrives, send window is full\n");
-    window_full++;
+    if (TRACING(sim, 1))
+      printf("----%c: New message arrives, send window is full\n", NAME(e));
+    sim->window_full++;
+  }
+}
+
+void A_output(struct sim *sim, struct msg message)
+{
+  output(sim, A, message);
+}
+
+/* send queued messages while the window has room */
+static void drainqueue(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[e];
+  struct msg message;
+
+  while (p->windowcount + p->ackcount < sim->windowsize && msgq_pop(sim->sendq[e], &message, simtime(sim)))
+  {
+    if (TRACING(sim, 2))
+      printf("----%c: send window has room, send queued message to layer3!\n", NAME(e));
+    sendmessage(sim, e, message);
+    pbuf_release(sim, message.pbuf);
   }
 }
 
 
-/* called from layer 3, when a packet arrives for layer 4 
-   In this practical this will always be an ACK as B never sends data.
+/* mark the packet with the given sequence number ACKed.  Returns false
+   if it is not in the window or was ACKed already */
+static bool ackpacket(struct sim *sim, struct transfer *p, int seqnum)
+{
+  int offset, slot;
+
+  /* packets from seqfirst on occupy the window slots in order, whether
+     or not the sequence space is a multiple of the window size */
+  offset = (seqnum - p->buffer[p->windowfirst].seqnum + sim->seqspace) % sim->seqspace;
+  if (offset >= p->windowcount + p->ackcount)
+    return false;
+  slot = (p->windowfirst + offset) % sim->windowsize;
+  if (p->acked[slot])
+    return false;
+
+  /*NEW ACK mark as ture*/
+  p->acked[slot] = true;
+  canceltimer(p, slot);
+  p->lastnewack = simtime(sim);
+  if (p->senttime[slot] > p->ackedsent)
+    p->ackedsent = p->senttime[slot];
+
+  /* time the round trip of the packet, unless it was resent */
+  rto_newack(&p->rto);
+  if (p->resends[slot] == 0)
+    rto_sample(&p->rto, simtime(sim) - p->senttime[slot]);
+
+  p->windowcount--;
+
+  p->ackcount++;
+  return true;
+}
+
+/* called from layer 3 at e, when an ACK arrives for the sender there.
+   In simplex transfer this is every packet for A, as B never sends data.
 */
-void A_input(struct pkt packet)
+static void ackinput(struct sim *sim, int e, struct pkt packet)
 {
-  int i;
+  struct transfer *p = &sim->proto->t[e];
+  bool isnew = false;
+  int i, n;
 
  
   /* if received ACK is not corrupted */ 
-  if (!IsCorrupted(packet)) 
+  if (!IsCorrupted(sim, &packet)) 
   {
-    if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
-    total_ACKs_received++;
+    if (TRACING(sim, 1))
+      printf("----%c: uncorrupted ACK %d is received\n", NAME(e), packet.acknum);
+    sim->total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) 
+    if (p->windowcount != 0) 
     {
+      if (!sim->sack)
+        isnew = ackpacket(sim, p, packet.acknum);
+      else {
+        /* every packet up to acknum, unless the ACK is older than the
+           window, then the ones in the SACK bitmap */
+        n = (packet.acknum + 1 - p->buffer[p->windowfirst].seqnum + sim->seqspace) % sim->seqspace;
+        if (n > p->windowcount + p->ackcount)
+          n = 0;
+        for (i = 0; i < n; i++)
+          isnew |= ackpacket(sim, p, (packet.acknum - i + sim->seqspace) % sim->seqspace);
+        for (i = 0; i < SACKBITS; i++)
+          if (packet.sack & (uint32_t)1 << i)
+            isnew |= ackpacket(sim, p, (packet.acknum + 2 + i) % sim->seqspace);
+      }
 
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
-          /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) 
-        {
-
-            /* packet is a new ACK */
-            if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
-            /*NEW ACK mark as ture*/
-
-            buffer[packet.acknum % WINDOWSIZE].acknum = 1;
-
-            windowcount--;
-
-            ackcount++;
-
-            new_ACKs++;
-
-            if (buffer[windowfirst].seqnum == packet.acknum)
-            {
-
-              for (i = 0; i < WINDOWSIZE; i++)
-              {
-                /*check to see if start has been aked*/
-
-                if (buffer[windowfirst].acknum == 1)
-                {
+      if (isnew)
+      {
+        /* packet is a new ACK */
+        if (TRACING(sim, 1))
+          printf("----%c: ACK %d is not a duplicate\n", NAME(e), packet.acknum);
 
-                windowfirst = (windowfirst + 1) % WINDOWSIZE;
+        sim->new_ACKs++;
 
-                ackcount--;
-                }
+        /* slide past the ACKed packets at the start of the window,
+           but not into slots of packets that left it earlier */
+        while (p->ackcount > 0 && p->acked[p->windowfirst])
+        {
+          p->windowfirst = (p->windowfirst + 1) % sim->windowsize;
 
-              }
-                     
-            stoptimer(A);
-            if (windowcount > 0)
-             {
-              starttimer(A, RTT); 
-            }
-          }
+          p->ackcount--;
         }
-        else
-        if (TRACE > 0)
-          printf ("----A: duplicate ACK received, do nothing!\n");
+
+        /* fill the room freed in the window */
+        drainqueue(sim, e);
+        synctimer(sim, e);
       }
+      else
+        if (TRACING(sim, 1))
+          printf ("----%c: duplicate ACK received, do nothing!\n", NAME(e));
     }
+  }
   else 
   {
-    if (TRACE > 0)
-      printf ("----A: corrupted ACK is received, do nothing!\n");
+    if (TRACING(sim, 1))
+      printf ("----%c: corrupted ACK is received, do nothing!\n", NAME(e));
   }
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt(void)
+/* the packets of the sender at e reached the deadline the timer was
+   started for.  A deadline that has come is no proof of a loss: the
+   packet may still wait in a queue on the channel, and resending every
+   such packet would only make the queue longer, until the sender
+   collapses.  As the channel keeps packets in order, a packet is lost if
+   one first sent after it has been ACKed since, and then it is resent.
+   Otherwise only the oldest packet is resent, once no new ACK has come
+   for a timeout, as a single timer restarted on every new ACK would do.
+   The timer of a packet not resent starts again.  The first resend backs
+   off the timeout, if it is adaptive, until an ACK makes progress */
+static void rtxtimeout(struct sim *sim, int e)
 {
+  struct proto *pr = sim->proto;
+  struct transfer *p = &pr->t[e];
+  bool backedoff = false;
+  int slot, n;
 
-  int i;
-
-  if (TRACE > 0)
-  printf("----A: time out,resend packets!\n");
+  if (TRACING(sim, 1))
+  printf("----%c: time out,resend packets!\n", NAME(e));
 
-  if (windowcount > 0)
+  /* each packet at most once, even if its new deadline is not later */
+  for (n = p->ntimers; n > 0 && p->deadline[p->timerheap[0]] <= pr->timerdeadline[e]; n--)
   {
-    for (i = 0; i < WINDOWSIZE; i++)
+    slot = p->timerheap[0];
+    if (p->lastsent[slot] < p->ackedsent
+        || (slot == p->windowfirst && simtime(sim) - p->lastnewack >= p->rto.base))
     {
-      if (buffer[(i + windowfirst)%WINDOWSIZE].acknum != 1)
-      {
-        if (TRACE > 0)
-          printf ("---A: resending packet %d\n", (buffer[(windowfirst + i) % WINDOWSIZE]).seqnum);
-      tolayer3(A,buffer[(windowfirst + i) % WINDOWSIZE]);
-      packets_resent++;
-      starttimer(A,RTT);
-      /*Will be the oldest*/
-      break;
+      if (!backedoff) {
+        rto_backoff(&p->rto);
+        backedoff = true;
+      }
+      if (TRACING(sim, 1))
+        printf ("---%c: resending packet %d\n", NAME(e), p->buffer[slot].seqnum);
+      /* the ACK it carries is as old as the packet, and after the sequence
+         numbers wrapped its SACK bitmap would name packets not received */
+      if (sim->duplex && sim->sack) {
+        setack(sim, e, &p->buffer[slot]);
+        p->buffer[slot].checksum = ComputeChecksum(sim, &p->buffer[slot]);
       }
+      tolayer3(sim, e, p->buffer[slot]);
+      p->lastsent[slot] = simtime(sim);
+      p->resends[slot]++;
+      sim->packets_resent++;
     }
+    armtimer(p, slot, simtime(sim) + p->rto.timeout);
   }
 }       
 
 
 
-/* the following routine will be called once (only) before any other */
-/* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+/* initialise the window, buffer and sequence number of the sender at e */
+static void senderinit(struct sim *sim, int e)
 {
-  /* initialise A's window, buffer and sequence number */
+  struct transfer *p = &sim->proto->t[e];
+  int i;
 
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.  
+  p->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  p->windowfirst = 0;
+  p->windowlast = -1;   /* windowlast is where the last packet sent is stored.  
 		     new packets are placed in winlast + 1 
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
-
-  
+  p->windowcount = 0;
+  rto_init(&p->rto, sim->adaptiverto, sim->rtt);
+
+  /* no packet has a timer yet */
+  for (i = 0; i < sim->windowsize; i++)
+    p->heappos[i] = -1;
+  p->ntimers = 0;
+  p->ackedsent = 0.0;
+  p->lastnewack = 0.0;
 }
 
 
 
-/********* Receiver (B)  variables and procedures ************/
+/********* Receiver variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
-static struct pkt rcvBuffer[WINDOWSIZE];
-static int bWindowStart;
 
+/* start the delayed ACK timer of the receiver at e */
+static void startacktimer(struct sim *sim, int e)
+{
+  struct transfer *p = &sim->proto->t[1-e];
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+  p->acktimer = true;
+  p->ackdeadline = simtime(sim) + sim->ackdelay;
+  synctimer(sim, e);
+}
+
+static void stopacktimer(struct sim *sim, int e)
 {
-  struct pkt sendpkt;
-  int i;
-  int buffer_idx;
-  int seq;
-  bool in_window;
+  sim->proto->t[1-e].acktimer = false;
+  synctimer(sim, e);
+}
 
-  /* if not corrupted and received packet can be in any order buffer it */
-  if  ((!IsCorrupted(packet))) 
-  {
+/* send an ACK from the receiver at e for the packet seqnum or, with
+   SACK, for the last packet received in order with a bitmap of the
+   packets kept after it */
+static void sendack(struct sim *sim, int e, int seqnum)
+{
+  struct transfer *p = &sim->proto->t[1-e];
+  struct pkt sendpkt;
 
-    if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
-    
-    sendpkt.acknum = packet.seqnum; 
-      /* we don't have any data to send.  fill payload with 0's */
-    for (i=0; i<20 ; i++ ) 
-        sendpkt.payload[i] = '0';  
+  if (!sim->sack) {
+    sendpkt.acknum = seqnum;
+    sendpkt.sack = 0;
+  }
+  else
+    setack(sim, e, &sendpkt);
 
-    sendpkt.seqnum =  B_nextseqnum;
+  /* we don't have any data to send */
+  sendpkt.length = 0;
+  sendpkt.payload = NULL;
+  sendpkt.pbuf = NULL;
 
-    B_nextseqnum = (B_nextseqnum + 1) % SEQSPACE;
+  sendpkt.seqnum =  p->B_nextseqnum;
 
-        /* send an ACK for the received packet */
+  p->B_nextseqnum = (p->B_nextseqnum + 1) % sim->seqspace;
 
+  /* computer checksum */
+  sendpkt.checksum = ComputeChecksum(sim, &sendpkt); 
 
-    /* computer checksum */
-    sendpkt.checksum = ComputeChecksum(sendpkt); 
+  /* send out packet */
+  tolayer3 (sim, e, sendpkt);
+}
 
-    packets_received++;
-  
-    /* send out packet */
-    tolayer3 (B, sendpkt);
+/* called from layer 3 at e, when a data packet arrives for the receiver
+   there */
+static void datainput(struct sim *sim, int e, struct pkt packet)
+{
+  struct transfer *p = &sim->proto->t[1-e];
+  int delivered = 0;
+  int offset;
+  int slot;
 
-    buffer_idx = (expectedseqnum - 1 + WINDOWSIZE) % SEQSPACE;
+  /* if not corrupted and received packet can be in any order buffer it */
+  if  ((!IsCorrupted(sim, &packet))) 
+  {
 
-    seq = packet.seqnum;
-    
-    in_window = (((expectedseqnum <= buffer_idx) && (packet.seqnum >= expectedseqnum && packet.seqnum <= buffer_idx)) ||
-    ((expectedseqnum > buffer_idx) && (packet.seqnum >= expectedseqnum || packet.seqnum <= buffer_idx)));
+    if (TRACING(sim, 1))
+      printf("----%c: packet %d is correctly received, send ACK!\n", NAME(e), packet.seqnum);
 
+    sim->packets_received++;
 
+    /* packets in the window occupy the slots from bWindowStart on, in
+       order of sequence number */
+    offset = (packet.seqnum - p->expectedseqnum + sim->seqspace) % sim->seqspace;
 
-    if (in_window){
+    if (offset < sim->windowsize){
 
-    /*Check to see if packet was previously recieved*/ 
+      /* keep a reference to the payload, it is only valid during this call */
+      slot = (p->bWindowStart + offset) % sim->windowsize;
+      pbuf_release(sim, p->rcvBuffer[slot].pbuf);
+      pbuf_hold(packet.pbuf);
+      p->rcvBuffer[slot] = packet;
 
-      rcvBuffer[seq % WINDOWSIZE] = packet;
-  
-      if (packet.seqnum == expectedseqnum)
+      /* deliver the packets that are now in order, and free their slots */
+      while (p->rcvBuffer[p->bWindowStart].seqnum == p->expectedseqnum)
       {
-        for (i = 0; i < WINDOWSIZE; i++)
-        {
-          if (rcvBuffer[bWindowStart].seqnum == expectedseqnum)
-          {
-            tolayer5(B, rcvBuffer[windowfirst].payload);
-            bWindowStart = (bWindowStart + 1) %WINDOWSIZE;
-            expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
-          }
-        }
+        tolayer5(sim, e, p->rcvBuffer[p->bWindowStart].payload, p->rcvBuffer[p->bWindowStart].length);
+        p->rcvBuffer[p->bWindowStart].seqnum = NOTINUSE;
+        p->bWindowStart = (p->bWindowStart + 1) %sim->windowsize;
+        p->expectedseqnum = (p->expectedseqnum + 1) % sim->seqspace;
+        delivered++;
       }
     }
+
+    /* every packet needs an ACK of its own, unless the ACKs are
+       cumulative.  Then only every ackevery-th packet received in order
+       is ACKed, at the latest ackdelay after the first one not ACKed, but
+       a packet out of order or one that fills a gap is ACKed at once.
+       With duplex, data sent meanwhile carries the ACK */
+    if (!sim->sack || delivered != 1 || ++p->unacked >= sim->ackevery)
+      sendack(sim, e, packet.seqnum);
+    else if (!p->acktimer)
+      startacktimer(sim, e);
   }
 }
 
+/* the delayed ACK timer of the receiver at e went off, ackdelay after a
+   packet that has not been ACKed */
+static void acktimeout(struct sim *sim, int e)
+{
+  if (TRACING(sim, 1))
+    printf("----%c: ACK delay is over, send ACK!\n", NAME(e));
+  sendack(sim, e, NOTINUSE);
+}
+
  
 
-/* the following routine will be called once (only) before any other */
-/* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+/* initialise the receiver at e */
+static void receiverinit(struct sim *sim, int e)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
-  bWindowStart = 0;
+  struct transfer *p = &sim->proto->t[1-e];
+  int i;
 
+  p->expectedseqnum = 0;
+  p->B_nextseqnum = 1;
+  p->bWindowStart = 0;
+  p->unacked = 0;
+  p->acktimer = false;
+
+  /* no packet is kept yet */
+  for (i = 0; i < sim->windowsize; i++)
+    p->rcvBuffer[i].seqnum = NOTINUSE;
 }
 
-/******************************************************************************
- * The following functions need be completed only for bi-directional messages *
- *****************************************************************************/
 
-/* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)  
+/********* Entities A and B ************/
+
+/* called from layer 3 at e.  A packet without data is an ACK, and with
+   duplex and cumulative ACKs a data packet carries an ACK as well */
+static void input(struct sim *sim, int e, struct pkt packet)
+{
+  if (packet.length == 0)
+    ackinput(sim, e, packet);
+  else {
+    if (sim->duplex && sim->sack && !IsCorrupted(sim, &packet))
+      ackinput(sim, e, packet);
+    datainput(sim, e, packet);
+  }
+}
+
+/* called when the timer of e goes off, at the earliest of the deadlines
+   of its sender and receiver */
+static void timerinterrupt(struct sim *sim, int e)
 {
+  struct proto *pr = sim->proto;
+  struct transfer *snd = &pr->t[e], *rcv = &pr->t[1-e];
+
+  pr->timerrunning[e] = false;
+  if (rcv->acktimer && rcv->ackdeadline <= pr->timerdeadline[e]) {
+    rcv->acktimer = false;
+    acktimeout(sim, e);
+  }
+  if (snd->ntimers > 0 && snd->deadline[snd->timerheap[0]] <= pr->timerdeadline[e])
+    rtxtimeout(sim, e);
+  synctimer(sim, e);
 }
 
-/* called when B's timer goes off */
-void B_timerinterrupt(void)
+void A_input(struct sim *sim, struct pkt packet)
 {
+  input(sim, A, packet);
 }
 
+void A_timerinterrupt(struct sim *sim)
+{
+  timerinterrupt(sim, A);
+}
+
+/* the following routine will be called once (only) before any other */
+/* entity A routines are called. You can use it to do any initialization */
+void A_init(struct sim *sim)
+{
+  sim->proto->timerrunning[A] = false;
+  senderinit(sim, A);
+  if (sim->duplex)
+    receiverinit(sim, A);
+}
+
+void B_input(struct sim *sim, struct pkt packet)
+{
+  input(sim, B, packet);
+}
+
+void B_timerinterrupt(struct sim *sim)
+{
+  timerinterrupt(sim, B);
+}
+
+/* the following routine will be called once (only) before any other */
+/* entity B routines are called. You can use it to do any initialization */
+void B_init(struct sim *sim)
+{
+  sim->proto->timerrunning[B] = false;
+  receiverinit(sim, B);
+  if (sim->duplex)
+    senderinit(sim, B);
+}
+
+/* with duplex, B sends data to A as well */
+void B_output(struct sim *sim, struct msg message)  
+{
+  output(sim, B, message);
+}
@@ -1,13 +1,19 @@
 #include <stdbool.h>
-extern void A_init(void);
-extern void B_init(void);
-extern void A_input(struct pkt);
-extern void B_input(struct pkt);
-extern void A_output(struct msg);
-extern void A_timerinterrupt(void);
+extern struct proto *proto_alloc(struct sim *);
+extern void proto_free(struct proto *);
+/* smallest sequence space that works with the window size and ACK format
+   of the parameters */
+extern int proto_minseqspace(const struct simparams *);
+/* whether B sends data as well with the duplex parameter */
+extern int proto_duplex(void);
+extern void A_init(struct sim *);
+extern void B_init(struct sim *);
+extern void A_input(struct sim *, struct pkt);
+extern void B_input(struct sim *, struct pkt);
+extern void A_output(struct sim *, struct msg);
+extern void A_timerinterrupt(struct sim *);
 extern void reset_hardware_timer(void);
 extern bool isInWindow(int , int );
-/* included for extension to bidirectional communication */
-#define BIDIRECTIONAL 0       /*  0 = A->B  1 =  A<->B */
-extern void B_output(struct msg);
-extern void B_timerinterrupt(void);
\ No newline at end of file
+/* used for bidirectional communication, with the duplex parameter */
+extern void B_output(struct sim *, struct msg);
+extern void B_timerinterrupt(struct sim *);
@@ -2,145 +2,228 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "emulator.h"
+#include "checksum.h"
+#include "rto.h"
 #include "gbn.h"
 
-#define RTT 16.0
-#define WINDOWSIZE 6
-#define SEQSPACE 7
+/* RTT, WINDOWSIZE and SEQSPACE are the rtt, window and seqspace parameters */
 #define NOTINUSE (-1)
 
-int ComputeChecksum(struct pkt packet) {
-    int checksum = 0;
-    int i;
-    checksum += packet.seqnum + packet.acknum;
-    for(i=0; i<20; i++)
-        checksum += (int)packet.payload[i];
-    return checksum;
+int ComputeChecksum(struct sim *sim, const struct pkt *packet) {
+    return checksum_packet(sim->checksum, packet->seqnum, packet->acknum, packet->sack,
+                           packet->length, packet->payload);
+}
+
+bool IsCorrupted(struct sim *sim, const struct pkt *packet) {
+    /* numbers outside the sequence space are corruption the checksum missed,
+       and would index acked and rcv_buffer out of bounds */
+    if(packet->seqnum < NOTINUSE || packet->seqnum >= sim->seqspace
+       || packet->acknum < NOTINUSE || packet->acknum >= sim->seqspace)
+        return true;
+    return packet->checksum != ComputeChecksum(sim, packet);
+}
+
+/* state of A and B, one for every simulation */
+struct proto {
+    /* sender (A) */
+    struct pkt *buffer;
+    float *sent_time;   /* first transmission of each packet in buffer */
+    bool *resent;       /* resent since, so not timed (Karn's rule) */
+    struct rto rto;
+    int send_base;
+    int next_seq;
+    bool *acked;
+    int window_count;
+
+    /* receiver (B) */
+    int expected_seq;
+    struct pkt *rcv_buffer;
+};
+
+struct proto *proto_alloc(struct sim *sim) {
+    struct proto *p = calloc(1, sizeof(struct proto));
+    if(p == NULL) {
+        printf("memory allocation for protocol state failed.");
+        exit(EXIT_FAILURE);
+    }
+    p->buffer = calloc(sim->windowsize, sizeof(struct pkt));
+    p->acked = calloc(sim->seqspace, sizeof(bool));
+    p->rcv_buffer = calloc(sim->seqspace, sizeof(struct pkt));
+    p->sent_time = calloc(sim->windowsize, sizeof(float));
+    p->resent = calloc(sim->windowsize, sizeof(bool));
+    if(p->buffer == NULL || p->acked == NULL || p->rcv_buffer == NULL
+       || p->sent_time == NULL || p->resent == NULL) {
+        printf("memory allocation for protocol state failed.");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* payload buffers still referenced are freed with the simulation */
+void proto_free(struct proto *p) {
+    free(p->buffer);
+    free(p->acked);
+    free(p->rcv_buffer);
+    free(p->sent_time);
+    free(p->resent);
+    free(p);
+}
+
+/* SR needs a sequence space of at least twice the window */
+int proto_minseqspace(const struct simparams *params) {
+    return 2 * params->window;
 }
 
-bool IsCorrupted(struct pkt packet) {
-    return packet.checksum != ComputeChecksum(packet);
+/* only A sends data, B_output and B_timerinterrupt are stubs */
+int proto_duplex(void) {
+    return 0;
 }
 
 /********** Sender (A) **********/
-static struct pkt buffer[WINDOWSIZE];
-static int send_base = 0;
-static int next_seq = 0;
-static bool acked[SEQSPACE] = {false};
-static int window_count = 0;
-
-void A_output(struct msg message) {
-    if(window_count < WINDOWSIZE) {
+
+void A_output(struct sim *sim, struct msg message) {
+    struct proto *p = sim->proto;
+
+    if(p->window_count < sim->windowsize) {
         struct pkt pkt;
-        pkt.seqnum = next_seq;
+        pkt.seqnum = p->next_seq;
         pkt.acknum = NOTINUSE;
-        int i;
-        for(i=0; i<20; i++)
-            pkt.payload[i] = message.data[i];
-        pkt.checksum = ComputeChecksum(pkt);
+        pkt.sack = 0;
+        pkt.length = message.length;
+        pkt.payload = message.data;
+        pkt.pbuf = message.pbuf;
+        pkt.checksum = ComputeChecksum(sim, &pkt);
         
-        buffer[next_seq % WINDOWSIZE] = pkt;
-        acked[next_seq] = false;
-        window_count++;
+        pbuf_release(sim, p->buffer[p->next_seq % sim->windowsize].pbuf);
+        pbuf_hold(pkt.pbuf);
+        p->buffer[p->next_seq % sim->windowsize] = pkt;
+        p->sent_time[p->next_seq % sim->windowsize] = simtime(sim);
+        p->resent[p->next_seq % sim->windowsize] = false;
+        p->acked[p->next_seq] = false;
+        p->window_count++;
         
-        if(TRACE > 0) printf("Sending packet %d\n", next_seq);
-        tolayer3(A, pkt);
+        if(TRACING(sim, 1)) printf("Sending packet %d\n", p->next_seq);
+        tolayer3(sim, A, pkt);
         
-        if(window_count == 1) starttimer(A, RTT);
+        if(p->window_count == 1) starttimer(sim, A, p->rto.timeout);
             
-        next_seq = (next_seq + 1) % SEQSPACE;
+        p->next_seq = (p->next_seq + 1) % sim->seqspace;
     } else {
-        if(TRACE > 0) printf("----A: Window full\n");
+        if(TRACING(sim, 1)) printf("----A: Window full\n");
+        sim->window_full++;
     }
 }
 
-void A_input(struct pkt packet) {
-    if(!IsCorrupted(packet)) {
+void A_input(struct sim *sim, struct pkt packet) {
+    struct proto *p = sim->proto;
+
+    if(!IsCorrupted(sim, &packet)) {
         int ack = packet.acknum;
-        int window_start = send_base;
-        int window_end = (send_base + WINDOWSIZE) % SEQSPACE;
+        int window_start = p->send_base;
+        int window_end = (p->send_base + sim->windowsize) % sim->seqspace;
         
         bool in_window = (window_start <= window_end) ? 
             (ack >= window_start && ack < window_end) :
             (ack >= window_start || ack < window_end);
         
-        if(in_window && !acked[ack]) {
-            acked[ack] = true;
-            if(TRACE > 0) printf("----A: ACK %d received\n", ack);
+        if(in_window && !p->acked[ack]) {
+            p->acked[ack] = true;
+            rto_newack(&p->rto);
+            if(!p->resent[ack % sim->windowsize])
+                rto_sample(&p->rto, simtime(sim) - p->sent_time[ack % sim->windowsize]);
+            if(TRACING(sim, 1)) printf("----A: ACK %d received\n", ack);
    
-            while(acked[send_base] && window_count > 0) {
-                acked[send_base] = false;
-                send_base = (send_base + 1) % SEQSPACE;
-                window_count--;
+            while(p->acked[p->send_base] && p->window_count > 0) {
+                p->acked[p->send_base] = false;
+                p->send_base = (p->send_base + 1) % sim->seqspace;
+                p->window_count--;
             }
             
            
-            stoptimer(A);
-            if(window_count > 0) starttimer(A, RTT);
+            stoptimer(sim, A);
+            if(p->window_count > 0) starttimer(sim, A, p->rto.timeout);
         }
     }
 }
 
-void A_timerinterrupt() {
-    if(TRACE > 0) printf("----A: Timeout, resending packet %d\n", send_base);
-    tolayer3(A, buffer[send_base % WINDOWSIZE]);
-    starttimer(A, RTT);
+void A_timerinterrupt(struct sim *sim) {
+    struct proto *p = sim->proto;
+
+    if(TRACING(sim, 1)) printf("----A: Timeout, resending packet %d\n", p->send_base);
+    tolayer3(sim, A, p->buffer[p->send_base % sim->windowsize]);
+    p->resent[p->send_base % sim->windowsize] = true;
+    rto_backoff(&p->rto);
+    starttimer(sim, A, p->rto.timeout);
 }
 
-void A_init() {
-    send_base = 0;
-    next_seq = 0;
-    window_count = 0;
+void A_init(struct sim *sim) {
+    struct proto *p = sim->proto;
+
+    p->send_base = 0;
+    p->next_seq = 0;
+    p->window_count = 0;
     int i;
-    for(i=0; i<SEQSPACE; i++) acked[i] = false;
+    for(i=0; i<sim->seqspace; i++) p->acked[i] = false;
+    rto_init(&p->rto, sim->adaptiverto, sim->rtt);
 }
 
 /********** Receiver (B) **********/
-static int expected_seq = 0;
-static struct pkt rcv_buffer[SEQSPACE];
 
-void B_input(struct pkt packet) {
-    if(!IsCorrupted(packet)) {
+void B_input(struct sim *sim, struct pkt packet) {
+    struct proto *p = sim->proto;
+
+    if(!IsCorrupted(sim, &packet)) {
         int seq = packet.seqnum;
-        int window_start = expected_seq;
-        int window_end = (expected_seq + WINDOWSIZE) % SEQSPACE;
+        int window_start = p->expected_seq;
+        int window_end = (p->expected_seq + sim->windowsize) % sim->seqspace;
         
         bool in_window = (window_start <= window_end) ?
             (seq >= window_start && seq < window_end) :
             (seq >= window_start || seq < window_end);
         
         if(in_window) {
-            if(TRACE > 0) printf("----B: Received packet %d\n", seq);
-            rcv_buffer[seq] = packet; 
+            if(TRACING(sim, 1)) printf("----B: Received packet %d\n", seq);
+            pbuf_release(sim, p->rcv_buffer[seq].pbuf);
+            pbuf_hold(packet.pbuf);
+            p->rcv_buffer[seq] = packet; 
             
           
-            while(rcv_buffer[expected_seq].seqnum == expected_seq) {
-                if(TRACE > 0) printf("----B: Delivering packet %d to layer5\n", expected_seq);
-                tolayer5(B, rcv_buffer[expected_seq].payload);
-                expected_seq = (expected_seq + 1) % SEQSPACE;
+            while(p->rcv_buffer[p->expected_seq].seqnum == p->expected_seq) {
+                if(TRACING(sim, 1)) printf("----B: Delivering packet %d to layer5\n", p->expected_seq);
+                tolayer5(sim, B, p->rcv_buffer[p->expected_seq].payload, p->rcv_buffer[p->expected_seq].length);
+                /* free the slot, or the loop would deliver it again once
+                   the sequence numbers wrap */
+                pbuf_release(sim, p->rcv_buffer[p->expected_seq].pbuf);
+                p->rcv_buffer[p->expected_seq].pbuf = NULL;
+                p->rcv_buffer[p->expected_seq].seqnum = NOTINUSE;
+                p->expected_seq = (p->expected_seq + 1) % sim->seqspace;
             }
         }
         
        
         struct pkt ack;
         ack.acknum = seq;
+        ack.sack = 0;
         ack.seqnum = NOTINUSE;
-        int i;
-        for(i=0; i<20; i++) ack.payload[i] = '0';
-        ack.checksum = ComputeChecksum(ack);
+        ack.length = 0;
+        ack.payload = NULL;
+        ack.pbuf = NULL;
+        ack.checksum = ComputeChecksum(sim, &ack);
         
-        if(TRACE > 0) printf("----B: Sending ACK %d\n", seq);
-        tolayer3(B, ack);
+        if(TRACING(sim, 1)) printf("----B: Sending ACK %d\n", seq);
+        tolayer3(sim, B, ack);
     }
 }
 
-void B_init() {
-    expected_seq = 0;
+void B_init(struct sim *sim) {
+    struct proto *p = sim->proto;
+
+    p->expected_seq = 0;
     int i;
-    for(i=0; i<SEQSPACE; i++) {
-        rcv_buffer[i].seqnum = -1; 
+    for(i=0; i<sim->seqspace; i++) {
+        p->rcv_buffer[i].seqnum = -1; 
     }
 }
 
-void B_output(struct msg message) {}
-void B_timerinterrupt() {}
\ No newline at end of file
+void B_output(struct sim *sim, struct msg message) {}
+void B_timerinterrupt(struct sim *sim) {}
\ No newline at end of file
@@ -0,0 +1,114 @@
+/* ******************************************************************
+   tracedump: print a binary trace written by the emulator (--bintrace)
+   in the form of the emulator's trace output, or as CSV.
+
+   usage: tracedump [--csv] file
+
+   Build with
+     gcc -ansi -pedantic -Wall tracedump.c -o tracedump
+**********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "bintrace.h"
+
+static const char *typenames[] = {
+  "timerinterrupt", "fromlayer5", "fromlayer3", "tolayer3", "tolayer5",
+  "starttimer", "stoptimer"
+};
+#define NTYPES ((int)(sizeof(typenames) / sizeof(typenames[0])))
+
+static void printtext(const struct tracerec *r)
+{
+  char entity = r->entity == 0 ? 'A' : 'B';
+
+  switch (r->type) {
+  case TR_TIMEOUT:
+  case TR_FROMLAYER5:
+  case TR_FROMLAYER3:
+    printf("\nEVENT time: %f,", r->time);
+    printf("  type: %d", r->type);
+    if (r->type == TR_TIMEOUT)
+      printf(", timerinterrupt  ");
+    else if (r->type == TR_FROMLAYER5)
+      printf(", fromlayer5 ");
+    else
+      printf(", fromlayer3 ");
+    printf(" entity: %d\n", r->entity);
+    if (r->type == TR_FROMLAYER3)
+      printf("          FROMLAYER3: seq: %d, ack %d, check: %d\n", r->seqnum, r->acknum, r->checksum);
+    break;
+  case TR_TOLAYER3:
+    printf("          TOLAYER3: seq: %d, ack %d, check: %d\n", r->seqnum, r->acknum, r->checksum);
+    if (r->flags & TRF_LOST)
+      printf("          TOLAYER3: packet being lost\n");
+    if (r->flags & TRF_CORRUPT)
+      printf("          TOLAYER3: packet being corrupted\n");
+    break;
+  case TR_TOLAYER5:
+    printf("          TOLAYER5: data received by application at %c\n", entity);
+    break;
+  case TR_STARTTIMER:
+    printf("          START TIMER: starting timer at %f\n", r->time);
+    break;
+  case TR_STOPTIMER:
+    printf("          STOP TIMER: stopping timer at %f\n", r->time);
+    break;
+  default:
+    printf("unknown trace record type %d\n", r->type);
+    break;
+  }
+}
+
+static void printcsv(const struct tracerec *r)
+{
+  printf("%f,%s,%c,%d,%d,%d,%d,%d\n", r->time,
+         r->type < NTYPES ? typenames[r->type] : "unknown", r->entity == 0 ? 'A' : 'B',
+         r->seqnum, r->acknum, r->checksum,
+         (r->flags & TRF_LOST) != 0, (r->flags & TRF_CORRUPT) != 0);
+}
+
+int main(int argc, char **argv)
+{
+  struct traceheader h;
+  struct tracerec r;
+  const char *filename = NULL;
+  FILE *in;
+  int csv = 0, i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--csv") == 0)
+      csv = 1;
+    else if (filename == NULL && argv[i][0] != '-')
+      filename = argv[i];
+    else {
+      filename = NULL;        /* print the usage */
+      break;
+    }
+  }
+  if (filename == NULL) {
+    printf("usage: %s [--csv] file\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  in = fopen(filename, "rb");
+  if (in == NULL) {
+    printf("unable to open %s\n", filename);
+    return EXIT_FAILURE;
+  }
+  if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, BINTRACE_MAGIC, sizeof(BINTRACE_MAGIC)) != 0
+      || h.recsize != (int)sizeof(struct tracerec)) {
+    printf("%s is not a trace written by this version of the emulator\n", filename);
+    return EXIT_FAILURE;
+  }
+
+  if (csv)
+    printf("time,event,entity,seqnum,acknum,checksum,lost,corrupt\n");
+  while (fread(&r, sizeof(r), 1, in) == 1) {
+    if (csv)
+      printcsv(&r);
+    else
+      printtext(&r);
+  }
+  fclose(in);
+  return EXIT_SUCCESS;
+}